@@ -23,6 +23,21 @@
 #include "commands.h"
 #include "init_finalize.h"
 #include "lapply.h"
+#include "lapply_helpers.h"
+#include "lapply_dynamic.h"
+#include "lapply_pipelined.h"
+#include "vapply.h"
+#include "lapply_async.h"
+#include "mapreduce.h"
+#include "profile.h"
+#include "cache.h"
+#include "compress.h"
+#include "export.h"
+#include "group.h"
+#include "pool.h"
+#include "resident.h"
+#include "mapply.h"
+#include "apply.h"
 #include "getrank.h"
 #include "state.h"
 #include "compiler_directives.h"
@@ -30,11 +45,32 @@
 
 /* Set up R .Call info */
 R_CallMethodDef callMethods[] = {
-{"initPiebaldMPI", (void*(*)())&initPiebaldMPI, 0},
+{"initPiebaldMPI", (void*(*)())&initPiebaldMPI, 5},
 {"finalizePiebaldMPI", (void*(*)())&finalizePiebaldMPI, 0},
 {"getrankPiebaldMPI", (void*(*)())&getrankPiebaldMPI, 0},
 {"getsizePiebaldMPI", (void*(*)())&getsizePiebaldMPI, 0},
-{"lapplyPiebaldMPI", (void*(*)())&lapplyPiebaldMPI, 3},
+{"lapplyPiebaldMPI", (void*(*)())&lapplyPiebaldMPI, 5},
+{"lapplyDynamicPiebaldMPI", (void*(*)())&lapplyDynamicPiebaldMPI, 5},
+{"lapplyStreamPiebaldMPI", (void*(*)())&lapplyStreamPiebaldMPI, 5},
+{"lapplyPipelinedPiebaldMPI", (void*(*)())&lapplyPipelinedPiebaldMPI, 7},
+{"vapplyPiebaldMPI", (void*(*)())&vapplyPiebaldMPI, 6},
+{"lapplyAsyncPiebaldMPI", (void*(*)())&lapplyAsyncPiebaldMPI, 5},
+{"pollAsyncPiebaldMPI", (void*(*)())&pollAsyncPiebaldMPI, 1},
+{"waitAsyncPiebaldMPI", (void*(*)())&waitAsyncPiebaldMPI, 1},
+{"mapReducePiebaldMPI", (void*(*)())&mapReducePiebaldMPI, 7},
+{"serializePiebaldMPI", (void*(*)())&serializePiebaldMPI, 2},
+{"profilePiebaldMPI", (void*(*)())&profilePiebaldMPI, 1},
+{"exportPiebaldMPI", (void*(*)())&exportPiebaldMPI, 3},
+{"unexportPiebaldMPI", (void*(*)())&unexportPiebaldMPI, 2},
+{"groupPiebaldMPI", (void*(*)())&groupPiebaldMPI, 1},
+{"trimBuffersPiebaldMPI", (void*(*)())&trimBuffersPiebaldMPI, 0},
+{"distributePiebaldMPI", (void*(*)())&distributePiebaldMPI, 3},
+{"lapplyResidentPiebaldMPI", (void*(*)())&lapplyResidentPiebaldMPI, 4},
+{"collectPiebaldMPI", (void*(*)())&collectPiebaldMPI, 2},
+{"freeResidentPiebaldMPI", (void*(*)())&freeResidentPiebaldMPI, 1},
+{"mapplyPiebaldMPI", (void*(*)())&mapplyPiebaldMPI, 5},
+{"applyPiebaldMPI", (void*(*)())&applyPiebaldMPI, 6},
+{"clearCachePiebaldMPI", (void*(*)())&clearCachePiebaldMPI, 0},
 {NULL, NULL, 0}
 };
 
@@ -0,0 +1,367 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * A parallel apply over the first or last dimension of a typed array.
+ * Each process receives a contiguous block of slices straight into a
+ * native buffer, with derived datatypes describing the strided rows,
+ * and rebuilds the slices locally without serialization.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply.h"
+#include "lapply_helpers.h"
+#include "lapply_workers_helpers.h"
+#include "cache.h"
+#include "typed.h"
+#include "apply.h"
+#include "profile.h"
+
+// Elements of the layout list built by pbApply().
+enum Layout { LAYOUT_DIM, LAYOUT_DIMNAMES, LAYOUT_MARGIN, LAYOUT_BLOCKS, 
+   LAYOUT_TEMPLATE, LAYOUT_SLICE_DIM, LAYOUT_SLICE_DIMNAMES };
+
+/**
+   The number of elements in one slice of the array.
+
+   @param[in] layout       R list describing the array
+   @return                 product of the dimensions that are not MARGIN
+*/
+static int sliceLength(SEXP layout) {
+   int i, length = 1;
+   SEXP sliceDim = VECTOR_ELT(layout, LAYOUT_SLICE_DIM);
+
+   for(i = 0; i < LENGTH(sliceDim); i++) {
+      length *= INTEGER(sliceDim)[i];
+   }
+   return(length);
+}
+
+/**
+   Test whether the slices run along the first dimension.
+
+   The array is viewed as a column-major matrix with the slices as
+   its rows when MARGIN is the first dimension, or as its columns when
+   MARGIN is the last dimension.
+
+   @param[in] layout       R list describing the array
+   @return                 TRUE when MARGIN is the first dimension
+*/
+static int slicesAreRows(SEXP layout) {
+   return(asInteger(VECTOR_ELT(layout, LAYOUT_MARGIN)) == 1);
+}
+
+/**
+   The datatype of one slice of an array.
+
+   A row is strided in column-major storage, so it is a vector type
+   resized to the extent of one element: consecutive rows then start
+   one element apart, and a count of rows describes a row block. A 
+   column is contiguous.
+
+   @param[in] type         R vector type of the array
+   @param[in] rows         TRUE when the slices are rows
+   @param[in] length       number of elements in one slice
+   @param[in] stride       number of rows of the buffer (rows only)
+   @return                 committed MPI datatype, freed by the caller
+*/
+static MPI_Datatype sliceDatatype(SEXPTYPE type, int rows, int length, 
+   int stride) {
+
+   MPI_Datatype strided, datatype;
+
+   if (rows) {
+      MPI_Type_vector(length, 1, stride, typedDatatype(type), &strided);
+      MPI_Type_create_resized(strided, 0, 
+         (MPI_Aint) typedElementSize(type), &datatype);
+      MPI_Type_free(&strided);
+   } else {
+      MPI_Type_contiguous(length, typedDatatype(type), &datatype);
+   }
+   MPI_Type_commit(&datatype);
+
+   return(datatype);
+}
+
+/**
+   Scatter a contiguous block of slices of the array to every process.
+
+   Each block is received as a compact column-major buffer holding
+   count rows, or count columns, of the matrix view of the array.
+
+   @param[in]  x           R array (supervisor only)
+   @param[in]  layout      R list describing the array
+   @param[in]  argBase     R integer vector of 1-based first slices
+                           (supervisor only)
+   @param[in]  argCount    R integer vector of slice counts
+                           (supervisor only)
+   @param[out] base        1-based index of this process's first slice
+   @param[out] count       number of slices of this process
+   @return                 R vector with the block (not protected)
+*/
+static SEXP scatterBlocks(SEXP x, SEXP layout, SEXP argBase, 
+   SEXP argCount, int *base, int *count) {
+
+   int i, *counts = NULL, *displacements = NULL;
+   int rows = slicesAreRows(layout);
+   int length = sliceLength(layout);
+   SEXPTYPE type = TYPEOF(VECTOR_ELT(layout, LAYOUT_TEMPLATE));
+   MPI_Datatype sendType = MPI_DATATYPE_NULL, receiveType;
+   SEXP block;
+   int phase = profileEnter(PROFILE_SCATTER);
+
+   if (readonly_rank == 0) {
+      counts        = Calloc(readonly_nproc, int);
+      displacements = Calloc(readonly_nproc, int);
+      for(i = 0; i < readonly_nproc; i++) {
+         counts[i] = INTEGER(argCount)[i];
+         displacements[i] = INTEGER(argBase)[i] - 1;
+      }
+      sendType = sliceDatatype(type, rows, length, 
+         INTEGER(VECTOR_ELT(layout, LAYOUT_DIM))[0]);
+   }
+
+   MPI_Scatter(counts, 1, MPI_INT, count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   MPI_Scatter(displacements, 1, MPI_INT, base, 1, MPI_INT, 0, 
+      MPI_COMM_WORLD);
+   (*base)++;
+
+   block = allocVector(type, (R_xlen_t) *count * length);
+   receiveType = sliceDatatype(type, rows, length, 
+      *count > 0 ? *count : 1);
+
+   MPI_Scatterv(readonly_rank == 0 ? typedDataPointer(x) : NULL, 
+      counts, displacements, sendType, typedDataPointer(block), *count, 
+      receiveType, 0, MPI_COMM_WORLD);
+
+   MPI_Type_free(&receiveType);
+   if (readonly_rank == 0) {
+      MPI_Type_free(&sendType);
+      Free(counts);
+      Free(displacements);
+   }
+   profileBytes(PROFILE_SCATTER, (double) XLENGTH(block) * 
+      typedElementSize(type));
+   profileLeave(phase);
+
+   return(block);
+}
+
+/**
+   Call the function on every slice of a block, as apply does.
+
+   A slice with a single dimension is a vector, named after that 
+   dimension. Otherwise it is an array with the remaining dimensions.
+
+   @param[in] block        R vector with the block
+   @param[in] count        number of slices in the block
+   @param[in] layout       R list describing the array
+   @param[in] theFunction  R function to apply
+   @param[in] remainder    R list of "..." arguments
+   @return                 R list with one result per slice (not protected)
+*/
+static SEXP applySlices(SEXP block, int count, SEXP layout, 
+   SEXP theFunction, SEXP remainder) {
+
+   int i, j;
+   int rows = slicesAreRows(layout);
+   int length = sliceLength(layout);
+   size_t size = typedElementSize(TYPEOF(block));
+   SEXP sliceDim = VECTOR_ELT(layout, LAYOUT_SLICE_DIM);
+   SEXP sliceDimnames = VECTOR_ELT(layout, LAYOUT_SLICE_DIMNAMES);
+   SEXP results, remainderList, slice, functionCall;
+   unsigned char *source, *target;
+
+   PROTECT(results = allocVector(VECSXP, count));
+   PROTECT(remainderList = Rf_VectorToPairList(remainder));
+
+   for(i = 0; i < count; i++) {
+      PROTECT(slice = allocVector(TYPEOF(block), length));
+      source = typedDataPointer(block);
+      target = typedDataPointer(slice);
+      if (rows) {
+         for(j = 0; j < length; j++) {
+            memcpy(target + (size_t) j * size, 
+               source + ((size_t) j * count + i) * size, size);
+         }
+      } else {
+         memcpy(target, source + (size_t) i * length * size, 
+            (size_t) length * size);
+      }
+
+      if (LENGTH(sliceDim) < 2) {
+         if (sliceDimnames != R_NilValue) {
+            setAttrib(slice, R_NamesSymbol, VECTOR_ELT(sliceDimnames, 0));
+         }
+      } else {
+         setAttrib(slice, R_DimSymbol, sliceDim);
+         if (sliceDimnames != R_NilValue) {
+            setAttrib(slice, R_DimNamesSymbol, sliceDimnames);
+         }
+      }
+
+      PROTECT(functionCall = LCONS(theFunction, 
+         LCONS(slice, remainderList)));
+      SET_VECTOR_ELT(results, i, eval(functionCall, R_GlobalEnv));
+      UNPROTECT(2);
+   }
+
+   UNPROTECT(2);
+   return(results);
+}
+
+/**
+   Call the function once on a whole block.
+
+   The block is an array with the dimensions of the input, but only
+   count entries along MARGIN, and the matching dimnames. The function
+   must return one value per slice.
+
+   @param[in] block        R vector with the block
+   @param[in] base         1-based index of the first slice in the block
+   @param[in] count        number of slices in the block
+   @param[in] layout       R list describing the array
+   @param[in] theFunction  R function to apply
+   @param[in] remainder    R list of "..." arguments
+   @return                 R list with one result per slice (not protected)
+*/
+static SEXP applyBlock(SEXP block, int base, int count, SEXP layout,
+   SEXP theFunction, SEXP remainder) {
+
+   int i, margin = asInteger(VECTOR_ELT(layout, LAYOUT_MARGIN)) - 1;
+   SEXP dim, dimnames, names, blockNames;
+   SEXP functionCall, value;
+
+   if (count == 0) {
+      return(allocVector(VECSXP, 0));
+   }
+
+   PROTECT(dim = duplicate(VECTOR_ELT(layout, LAYOUT_DIM)));
+   INTEGER(dim)[margin] = count;
+   setAttrib(block, R_DimSymbol, dim);
+
+   dimnames = VECTOR_ELT(layout, LAYOUT_DIMNAMES);
+   if (dimnames != R_NilValue) {
+      PROTECT(dimnames = duplicate(dimnames));
+      names = VECTOR_ELT(dimnames, margin);
+      if (names != R_NilValue) {
+         PROTECT(blockNames = allocVector(STRSXP, count));
+         for(i = 0; i < count; i++) {
+            SET_STRING_ELT(blockNames, i, STRING_ELT(names, base - 1 + i));
+         }
+         SET_VECTOR_ELT(dimnames, margin, blockNames);
+         UNPROTECT(1);
+      }
+      setAttrib(block, R_DimNamesSymbol, dimnames);
+      UNPROTECT(1);
+   }
+
+   PROTECT(functionCall = LCONS(theFunction, 
+      LCONS(block, Rf_VectorToPairList(remainder))));
+   PROTECT(value = eval(functionCall, R_GlobalEnv));
+   if (XLENGTH(value) != count) {
+      error("'FUN' must return one value per slice of the block");
+   }
+   value = coerceVector(value, VECSXP);
+   UNPROTECT(3);
+
+   return(value);
+}
+
+/**
+   Evaluate this process's block.
+
+   @return                 R list with one result per slice (not protected)
+*/
+static SEXP applyLocal(SEXP block, int base, int count, SEXP layout,
+   SEXP theFunction, SEXP remainder) {
+
+   SEXP results;
+   int phase = profileEnter(PROFILE_COMPUTE);
+
+   if (asLogical(VECTOR_ELT(layout, LAYOUT_BLOCKS))) {
+      results = applyBlock(block, base, count, layout, theFunction, 
+         remainder);
+   } else {
+      results = applySlices(block, count, layout, theFunction, remainder);
+   }
+   profileLeave(phase);
+
+   return(results);
+}
+
+
+SEXP applyPiebaldMPI(SEXP serializeFun, SEXP x, SEXP serializeRemainder,
+      SEXP serializeLayout, SEXP argBase, SEXP argCount) {
+
+   checkPiebaldInit();
+
+   int base, count;
+   SEXP workerResultsList, returnList;
+   SEXP theFunction, remainder, layout, block;
+
+   PROTECT(workerResultsList = allocVector(VECSXP, readonly_nproc));
+   PROTECT(returnList = allocVector(VECSXP, sumCounts(argCount)));
+
+   sendCommand(APPLY);
+
+   PROTECT(theFunction = sendFunction(serializeFun));
+
+   PROTECT(remainder = sendRemainder(serializeRemainder));
+
+   PROTECT(layout = sendCachedObject(serializeLayout));
+
+   PROTECT(block = scatterBlocks(x, layout, argBase, argCount, 
+      &base, &count));
+
+   SET_VECTOR_ELT(workerResultsList, 0, applyLocal(block, base, count,
+      layout, theFunction, remainder));
+
+   lapplyPiebaldMPI_doReceive(workerResultsList, returnList);
+
+   UNPROTECT(6);
+
+   return(returnList);
+}
+
+
+void applyWorkerPiebaldMPI() {
+   int base, count;
+   SEXP theFunction, remainder, layout, block, returnList;
+
+   theFunction = findFunction();
+
+   remainder = workerGetRemainder();
+
+   PROTECT(layout = receiveCachedObject());
+
+   PROTECT(block = scatterBlocks(R_NilValue, layout, R_NilValue, 
+      R_NilValue, &base, &count));
+
+   PROTECT(returnList = applyLocal(block, base, count, layout, 
+      theFunction, remainder));
+
+   sendReturnList(returnList);
+
+   UNPROTECT(5);
+}
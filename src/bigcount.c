@@ -0,0 +1,142 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * Point-to-point messages and broadcasts of any number of bytes.
+ *
+ * MPI counts are C ints. A message longer than INT_MAX bytes is 
+ * described by a single element of a derived datatype made of 
+ * BIGCOUNT_BLOCK_BYTES blocks followed by the remaining bytes. 
+ * Its type signature is still a sequence of bytes, so the sender 
+ * and the receiver each choose a description independently, and 
+ * the receiver reads the size of a probed message in bytes.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <mpi.h>
+#include <limits.h>
+
+#include "bigcount.h"
+
+/**
+   The datatype and count that describe a number of bytes.
+
+   The datatype must be released with freeByteType().
+
+   @param[in]  length      number of bytes
+   @param[out] count       number of elements of the datatype
+   @return                 MPI_BYTE, or a committed derived datatype
+*/
+static MPI_Datatype byteType(R_xlen_t length, int *count) {
+   int blockLengths[2];
+   MPI_Aint displacements[2];
+   MPI_Datatype types[2], block, datatype;
+
+   if (length <= INT_MAX) {
+      *count = (int) length;
+      return(MPI_BYTE);
+   }
+
+   MPI_Type_contiguous((int) BIGCOUNT_BLOCK_BYTES, MPI_BYTE, &block);
+
+   blockLengths[0]  = (int) (length / BIGCOUNT_BLOCK_BYTES);
+   blockLengths[1]  = (int) (length % BIGCOUNT_BLOCK_BYTES);
+   displacements[0] = 0;
+   displacements[1] = (MPI_Aint) blockLengths[0] * BIGCOUNT_BLOCK_BYTES;
+   types[0]         = block;
+   types[1]         = MPI_BYTE;
+
+   MPI_Type_create_struct(2, blockLengths, displacements, types, 
+      &datatype);
+   MPI_Type_commit(&datatype);
+   MPI_Type_free(&block);
+
+   *count = 1;
+   return(datatype);
+}
+
+/**
+   Release a datatype created by byteType().
+
+   Pending operations that use the datatype complete normally.
+
+   @param[in] datatype     the datatype
+*/
+static void freeByteType(MPI_Datatype datatype) {
+   if (datatype != MPI_BYTE) {
+      MPI_Type_free(&datatype);
+   }
+}
+
+void sendBytes(const void *buffer, R_xlen_t length, int dest, int tag,
+      MPI_Comm comm) {
+   int count;
+   MPI_Datatype datatype = byteType(length, &count);
+
+   MPI_Send((void*) buffer, count, datatype, dest, tag, comm);
+   freeByteType(datatype);
+}
+
+void isendBytes(const void *buffer, R_xlen_t length, int dest, int tag,
+      MPI_Comm comm, MPI_Request *request) {
+   int count;
+   MPI_Datatype datatype = byteType(length, &count);
+
+   MPI_Isend((void*) buffer, count, datatype, dest, tag, comm, request);
+   freeByteType(datatype);
+}
+
+void recvBytes(void *buffer, R_xlen_t length, int source, int tag,
+      MPI_Comm comm) {
+   int count;
+   MPI_Datatype datatype = byteType(length, &count);
+
+   MPI_Recv(buffer, count, datatype, source, tag, comm, 
+      MPI_STATUS_IGNORE);
+   freeByteType(datatype);
+}
+
+void irecvBytes(void *buffer, R_xlen_t length, int source, int tag,
+      MPI_Comm comm, MPI_Request *request) {
+   int count;
+   MPI_Datatype datatype = byteType(length, &count);
+
+   MPI_Irecv(buffer, count, datatype, source, tag, comm, request);
+   freeByteType(datatype);
+}
+
+void bcastBytes(void *buffer, R_xlen_t length, int root, MPI_Comm comm) {
+   int count;
+   MPI_Datatype datatype = byteType(length, &count);
+
+   MPI_Bcast(buffer, count, datatype, root, comm);
+   freeByteType(datatype);
+}
+
+/**
+   The number of bytes of a probed message.
+
+   @param[in] status       status returned by MPI_Probe()
+   @return                 number of bytes
+*/
+R_xlen_t probedLength(MPI_Status *status) {
+   MPI_Count length;
+
+   MPI_Get_elements_x(status, MPI_BYTE, &length);
+
+   return((R_xlen_t) length);
+}
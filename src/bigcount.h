@@ -0,0 +1,38 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef _bigcount_h
+#define _bigcount_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <mpi.h>
+
+// Size of the blocks that describe messages beyond INT_MAX bytes.
+#define BIGCOUNT_BLOCK_BYTES ((R_xlen_t) 1 << 30)
+
+void sendBytes(const void *buffer, R_xlen_t length, int dest, int tag,
+   MPI_Comm comm);
+void isendBytes(const void *buffer, R_xlen_t length, int dest, int tag,
+   MPI_Comm comm, MPI_Request *request);
+void recvBytes(void *buffer, R_xlen_t length, int source, int tag,
+   MPI_Comm comm);
+void irecvBytes(void *buffer, R_xlen_t length, int source, int tag,
+   MPI_Comm comm, MPI_Request *request);
+void bcastBytes(void *buffer, R_xlen_t length, int root, MPI_Comm comm);
+R_xlen_t probedLength(MPI_Status *status);
+
+#endif // _bigcount_h
@@ -0,0 +1,351 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Cache of unserialized objects (the function and the "..." arguments)
+ * keyed by the digest of their uncompressed serialized bytes.
+ *
+ * Every process runs the same sequence of lookups and insertions
+ * with the same keys, and eviction is deterministic, so the cache
+ * on the supervisor always mirrors the cache on the workers. The
+ * supervisor therefore knows whether the workers hold an object
+ * without asking them, and only broadcasts the payload on a miss.
+ *
+ * The supervisor also keeps the uncompressed serialized bytes of each
+ * object. An object is digested and compared with them when it is
+ * serialized, before it is compressed, so a digest collision is treated
+ * as a miss instead of silently reusing the wrong object, and a hit
+ * costs neither compression nor decompression.
+ *
+ * A cached closure is reused across calls, so changes that a function
+ * makes to its own enclosing environment persist between calls.
+ * Initialize the cache with a size of zero to disable it.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <mpi.h>
+#include <string.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply_helpers.h"
+#include "cache.h"
+#include "shared.h"
+#include "compress.h"
+#include "serialize.h"
+#include "pool.h"
+#include "profile.h"
+
+typedef struct {
+   CacheKey key;
+   SEXP object;
+   SEXP serialized;
+   unsigned long lastUse;
+} CacheEntry;
+
+static CacheEntry cache_entries[CACHE_ENTRIES];
+static int cache_count = 0;
+static double cache_bytes = 0;
+static double cache_maxBytes = 0;
+static unsigned long cache_clock = 0;
+
+/**
+   Compute the 64-bit FNV-1a hash of a byte array.
+
+   @param[in] bytes     the byte array
+   @param[in] length    number of bytes
+   @return              the hash value
+*/
+static uint64_t digestBytes(const unsigned char *bytes, int64_t length) {
+   uint64_t hash = 14695981039346656037ULL;
+   int64_t i;
+
+   for(i = 0; i < length; i++) {
+      hash ^= bytes[i];
+      hash *= 1099511628211ULL;
+   }
+
+   return(hash);
+}
+
+/**
+   Find the cache entry of an object.
+
+   @param[in] key       key of the serialized object
+   @return              index of the entry, or -1 on a cache miss
+*/
+static int findCache(CacheKey *key) {
+   int i;
+
+   for(i = 0; i < cache_count; i++) {
+      if (cache_entries[i].key.digest == key->digest &&
+            cache_entries[i].key.length == key->length) {
+         return(i);
+      }
+   }
+
+   return(-1);
+}
+
+/**
+   Return a cached object and mark it as most recently used.
+
+   @param[in] entry     index of the cache entry
+   @return              the cached object
+*/
+static SEXP useCache(int entry) {
+   cache_entries[entry].lastUse = ++cache_clock;
+   return(cache_entries[entry].object);
+}
+
+/**
+   Remove an object from the cache.
+
+   @param[in] entry     index of the cache entry
+*/
+static void removeCache(int entry) {
+   R_ReleaseObject(cache_entries[entry].object);
+   R_ReleaseObject(cache_entries[entry].serialized);
+   cache_bytes -= cache_entries[entry].key.length;
+   cache_count--;
+   cache_entries[entry] = cache_entries[cache_count];
+}
+
+/**
+   Remove the least recently used object from the cache.
+*/
+static void evictCache() {
+   int i, victim = 0;
+
+   for(i = 1; i < cache_count; i++) {
+      if (cache_entries[i].lastUse < cache_entries[victim].lastUse) {
+         victim = i;
+      }
+   }
+
+   removeCache(victim);
+}
+
+/**
+   Insert an object into the cache, evicting objects as needed.
+
+   An object whose key collides with a cached object replaces it.
+   Objects larger than the cache are not inserted.
+
+   @param[in] key          key of the serialized object
+   @param[in] object       the unserialized object
+   @param[in] serialized   R raw vector storing the uncompressed serialized
+                           object on the supervisor, R_NilValue on workers
+*/
+static void insertCache(CacheKey *key, SEXP object, SEXP serialized) {
+   int entry = findCache(key);
+
+   if (entry >= 0) {
+      removeCache(entry);
+   }
+
+   if (key->length > cache_maxBytes) {
+      return;
+   }
+
+   while(cache_count == CACHE_ENTRIES || 
+         cache_bytes + key->length > cache_maxBytes) {
+      evictCache();
+   }
+
+   R_PreserveObject(object);
+   R_PreserveObject(serialized);
+   cache_entries[cache_count].key = *key;
+   cache_entries[cache_count].object = object;
+   cache_entries[cache_count].serialized = serialized;
+   cache_entries[cache_count].lastUse = ++cache_clock;
+   cache_bytes += key->length;
+   cache_count++;
+}
+
+/**
+   Set the maximum size of the cache.
+
+   Must be called with the same value on every process.
+
+   @param[in] maxBytes  maximum total size of the serialized objects
+*/
+void initObjectCache(double maxBytes) {
+   cache_maxBytes = maxBytes;
+}
+
+/**
+   Remove all objects from the cache.
+*/
+void clearObjectCache() {
+   while(cache_count > 0) {
+      evictCache();
+   }
+   cache_clock = 0;
+}
+
+/**
+   Serialize an object that is broadcast through the cache.
+
+   The key is the digest of the uncompressed serialized bytes, so it 
+   does not depend on whether the payload happens to be compressed. If
+   the supervisor already caches the same bytes, their cached copy is 
+   returned as the payload and nothing is compressed. Otherwise the 
+   payload is compressed as usual and carries its key as an attribute.
+
+   @param[in] object       R object to serialize
+   @return                 R raw vector for sendCachedObject() 
+                           (not protected)
+*/
+SEXP serializeCachedObject(SEXP object) {
+   CacheKey key;
+   R_xlen_t length;
+   unsigned char *bytes;
+   SEXP payload, keyBytes;
+   int entry;
+   int phase = profileEnter(PROFILE_SERIALIZE);
+
+   PROTECT(object);
+   length = serializeToPool(object, POOL_SEND);
+   bytes = poolBuffer(POOL_SEND, length);
+   key.length = length;
+   key.digest = digestBytes(bytes, length);
+   profileBytes(PROFILE_SERIALIZE, length);
+
+   entry = findCache(&key);
+   if (entry >= 0 && cache_entries[entry].serialized != R_NilValue &&
+         memcmp(RAW(cache_entries[entry].serialized), bytes, length) == 0) {
+      releasePoolBuffer(POOL_SEND);
+      UNPROTECT(1);
+      profileLeave(phase);
+      return(cache_entries[entry].serialized);
+   }
+
+   PROTECT(payload = compressBytes(bytes, length));
+   if (payload == R_NilValue) {
+      UNPROTECT(1);
+      PROTECT(payload = allocVector(RAWSXP, length));
+      memcpy(RAW(payload), bytes, length);
+   }
+   releasePoolBuffer(POOL_SEND);
+
+   PROTECT(keyBytes = allocVector(RAWSXP, sizeof(CacheKey)));
+   memcpy(RAW(keyBytes), &key, sizeof(CacheKey));
+   setAttrib(payload, install("cacheKey"), keyBytes);
+   UNPROTECT(3);
+   profileLeave(phase);
+
+   return(payload);
+}
+
+/**
+   Broadcast an object from the supervisor to the worker processes.
+
+   Only the key of the object is broadcast if the payload is the cached
+   copy returned by serializeCachedObject(), which has already compared
+   the bytes. A payload serialized otherwise is digested here.
+
+   @param[in] serialized   R raw vector storing the serialized object,
+                           possibly compressed
+   @return                 the unserialized object (not protected)
+*/
+SEXP sendCachedObject(SEXP serialized) {
+   CacheMessage message;
+   SEXP bytes, keyBytes, object;
+   int entry, unserializePhase;
+   int phase = profileEnter(PROFILE_BROADCAST);
+
+   for(entry = 0; entry < cache_count; entry++) {
+      if (cache_entries[entry].serialized == serialized) {
+         message.key = cache_entries[entry].key;
+         message.payloadLength = 0;
+         MPI_Bcast(&message, sizeof(CacheMessage), MPI_BYTE, 0, 
+            MPI_COMM_WORLD);
+         profileLeave(phase);
+         return(useCache(entry));
+      }
+   }
+
+   PROTECT(bytes = decompressPayload(serialized));
+   keyBytes = getAttrib(serialized, install("cacheKey"));
+   if (keyBytes != R_NilValue) {
+      memcpy(&message.key, RAW(keyBytes), sizeof(CacheKey));
+   } else {
+      message.key.length = XLENGTH(bytes);
+      message.key.digest = digestBytes(RAW(bytes), message.key.length);
+   }
+   message.payloadLength = XLENGTH(serialized);
+   MPI_Bcast(&message, sizeof(CacheMessage), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+   profileBytes(PROFILE_BROADCAST, message.payloadLength);
+   broadcastPayload(serialized, message.payloadLength);
+   unserializePhase = profileEnter(PROFILE_UNSERIALIZE);
+   profileBytes(PROFILE_UNSERIALIZE, message.key.length);
+   PROTECT(object = unserializeFromBytes(RAW(bytes), message.key.length));
+   profileLeave(unserializePhase);
+   insertCache(&message.key, object, bytes);
+   UNPROTECT(2);
+   profileLeave(phase);
+
+   return(object);
+}
+
+/**
+   Receive an object broadcast by sendCachedObject().
+
+   A hit on an object this worker does not hold means that its cache 
+   has drifted from the supervisor's, which is raised as an error.
+
+   @return                 the unserialized object (not protected)
+*/
+SEXP receiveCachedObject() {
+   CacheMessage message;
+   SEXP object;
+   int entry;
+   int phase = profileEnter(PROFILE_BROADCAST);
+
+   MPI_Bcast(&message, sizeof(CacheMessage), MPI_BYTE, 0, MPI_COMM_WORLD);
+
+   if (message.payloadLength == 0) {
+      entry = findCache(&message.key);
+      profileLeave(phase);
+      if (entry < 0) {
+         error("The object cache of rank %d is out of step with the "
+            "supervisor.", readonly_rank);
+      }
+      return(useCache(entry));
+   }
+
+   profileBytes(PROFILE_BROADCAST, message.payloadLength);
+   PROTECT(object = broadcastPayload(R_NilValue, message.payloadLength));
+   insertCache(&message.key, object, R_NilValue);
+   UNPROTECT(1);
+   profileLeave(phase);
+
+   return(object);
+}
+
+SEXP clearCachePiebaldMPI() {
+   checkPiebaldInit();
+
+   sendCommand(CLEAR_CACHE);
+   clearObjectCache();
+
+   return(R_NilValue);
+}
@@ -0,0 +1,55 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _cache_h
+#define _cache_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <stdint.h>
+
+// Maximum number of objects held in the cache.
+#define CACHE_ENTRIES 64
+
+/*
+ * A serialized object is identified by the 64-bit FNV-1a hash
+ * of its uncompressed serialized bytes together with their length.
+ */
+typedef struct {
+   uint64_t digest;
+   int64_t length;
+} CacheKey;
+
+/*
+ * Broadcast by the supervisor for every cached object: the key, and the
+ * length of the payload that follows, or zero on a cache hit.
+ */
+typedef struct {
+   CacheKey key;
+   int64_t payloadLength;
+} CacheMessage;
+
+void initObjectCache(double maxBytes);
+void clearObjectCache();
+
+SEXP serializeCachedObject(SEXP object);
+SEXP sendCachedObject(SEXP serialized);
+SEXP receiveCachedObject();
+
+SEXP clearCachePiebaldMPI();
+
+#endif // _cache_h
@@ -1,7 +1,17 @@
 #ifndef _commands_h
 #define _commands_h
 
-enum Command { TERMINATE, LAPPLY };
+enum Command { TERMINATE, LAPPLY, LAPPLY_DYNAMIC, CLEAR_CACHE, 
+   LAPPLY_PIPELINED, VAPPLY, LAPPLY_ASYNC, EXPORT, UNEXPORT, MAP_REDUCE, 
+   PROFILE, GROUP, 
+   TRIM_BUFFERS, DISTRIBUTE, LAPPLY_RESIDENT, COLLECT, FREE_RESIDENT,
+   MAPPLY, APPLY };
+
+// Point-to-point message tags. Collective operations do not use tags.
+enum Tag { TAG_CHUNK_HEADER = 1, TAG_CHUNK_DATA, 
+   TAG_CHUNK_RESULT_HEADER, TAG_CHUNK_RESULT_DATA, TAG_ARGS, TAG_RESULTS,
+   TAG_NODE_ARGS, TAG_NODE_RESULTS, TAG_NODE_BUNDLE, TAG_NODE_PAYLOAD,
+   TAG_REDUCE, TAG_GROUP_JOB, TAG_ASYNC_JOB };
 
 
 #endif // _commands_h
@@ -0,0 +1,215 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <stdint.h>
+#include <string.h>
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include "compress.h"
+
+static int compressionEnabled = FALSE;
+static double compressionThreshold = 0;
+static double compressionBandwidth = 0;
+static int compressionBackoff = 0;
+
+/**
+   Configure the compression of payloads on this process.
+
+   @param[in] compression  R numeric vector { enabled, threshold in bytes,
+                           network bandwidth in bytes per second }
+*/
+void initCompression(SEXP compression) {
+   compressionEnabled   = (REAL(compression)[0] != 0);
+   compressionThreshold = REAL(compression)[1];
+   compressionBandwidth = REAL(compression)[2];
+   compressionBackoff   = 0;
+#ifndef HAVE_ZLIB
+   if (compressionEnabled) {
+      warning("PiebaldMPI was built without zlib, compression is disabled.");
+      compressionEnabled = FALSE;
+   }
+#endif
+}
+
+/**
+   Check whether a byte array holds a compressed payload.
+
+   @param[in] bytes        the payload
+   @param[in] length       number of bytes
+   @return                 TRUE if the payload is compressed
+*/
+int isCompressedBytes(const unsigned char *bytes, R_xlen_t length) {
+   return(length >= COMPRESSION_HEADER_LENGTH && 
+      memcmp(bytes, COMPRESSION_MAGIC, COMPRESSION_MAGIC_LENGTH) == 0);
+}
+
+/**
+   Compress the bytes of a serialized object if it is worth it.
+
+   Payloads below the threshold are never compressed. Compression is 
+   abandoned if the payload does not shrink enough, or if the time
+   spent compressing exceeds the time saved on the network. After a
+   failure the next COMPRESSION_BACKOFF payloads are sent as they are.
+   The payload is compressed into a vector of compressBound() bytes,
+   which is then shrunk to the compressed length with xlengthgets(),
+   so lengths beyond 2^31 are kept and no slack is left allocated.
+
+   @param[in] bytes        the serialized object, which may be a pooled
+                           buffer as well as the data of a raw vector
+   @param[in] length       number of bytes
+   @return                 R raw vector storing the compressed payload,
+                           or R_NilValue if the object is to be sent 
+                           as it is (not protected)
+*/
+SEXP compressBytes(const unsigned char *bytes, R_xlen_t length) {
+#ifdef HAVE_ZLIB
+   int i;
+   uLongf compressedLength;
+   double start, seconds;
+   SEXP payload;
+
+   if (!compressionEnabled || length < compressionThreshold) {
+      return(R_NilValue);
+   }
+   if (compressionBackoff > 0) {
+      compressionBackoff--;
+      return(R_NilValue);
+   }
+
+   compressedLength = compressBound(length);
+   PROTECT(payload = allocVector(RAWSXP, 
+      COMPRESSION_HEADER_LENGTH + compressedLength));
+
+   start = MPI_Wtime();
+   if (compress2(RAW(payload) + COMPRESSION_HEADER_LENGTH, 
+         &compressedLength, bytes, length, Z_BEST_SPEED) != Z_OK ||
+      compressedLength > COMPRESSION_MAX_RATIO * length) {
+      compressionBackoff = COMPRESSION_BACKOFF;
+      UNPROTECT(1);
+      return(R_NilValue);
+   }
+   seconds = MPI_Wtime() - start;
+
+   if (seconds * compressionBandwidth > length - compressedLength) {
+      compressionBackoff = COMPRESSION_BACKOFF;
+      UNPROTECT(1);
+      return(R_NilValue);
+   }
+
+   memcpy(RAW(payload), COMPRESSION_MAGIC, COMPRESSION_MAGIC_LENGTH);
+   for(i = 0; i < 8; i++) {
+      RAW(payload)[COMPRESSION_MAGIC_LENGTH + i] = 
+         (Rbyte) (((uint64_t) length >> (8 * i)) & 0xff);
+   }
+
+   payload = xlengthgets(payload, 
+      COMPRESSION_HEADER_LENGTH + compressedLength);
+   UNPROTECT(1);
+
+   return(payload);
+#else
+   (void) bytes;
+   (void) length;
+   return(R_NilValue);
+#endif
+}
+
+/**
+   Compress a serialized object if it is worth it.
+
+   @param[in] serialized   R raw vector storing a serialized object
+   @return                 R raw vector, either serialized itself or
+                           a compressed payload (not protected)
+*/
+SEXP compressPayload(SEXP serialized) {
+   SEXP payload;
+
+   PROTECT(serialized);
+   payload = compressBytes(RAW(serialized), XLENGTH(serialized));
+   UNPROTECT(1);
+
+   return(payload == R_NilValue ? serialized : payload);
+}
+
+/**
+   Restore the serialized object stored in a compressed byte array.
+
+   The bytes are read in place, so they may live outside R, for example
+   in a shared window.
+
+   @param[in] bytes        the compressed payload
+   @param[in] length       number of bytes
+   @return                 R raw vector storing a serialized object 
+                           (not protected)
+*/
+SEXP decompressBytes(const unsigned char *bytes, R_xlen_t length) {
+#ifdef HAVE_ZLIB
+   int i;
+   uint64_t serializedLength = 0;
+   uLongf outputLength;
+   SEXP serialized;
+
+   for(i = 0; i < 8; i++) {
+      serializedLength |= ((uint64_t) bytes[COMPRESSION_MAGIC_LENGTH + i]) 
+         << (8 * i);
+   }
+
+   PROTECT(serialized = allocVector(RAWSXP, serializedLength));
+   outputLength = serializedLength;
+   if (uncompress(RAW(serialized), &outputLength, 
+         bytes + COMPRESSION_HEADER_LENGTH,
+         length - COMPRESSION_HEADER_LENGTH) != Z_OK ||
+      outputLength != serializedLength) {
+      error("A compressed payload is corrupt.");
+   }
+   UNPROTECT(1);
+
+   return(serialized);
+#else
+   (void) bytes;
+   (void) length;
+   error("Received a compressed payload but PiebaldMPI was built without zlib.");
+   return(R_NilValue);
+#endif
+}
+
+/**
+   Restore the serialized object stored in a payload.
+
+   @param[in] payload      R raw vector received from another process
+   @return                 R raw vector storing a serialized object 
+                           (not protected)
+*/
+SEXP decompressPayload(SEXP payload) {
+   SEXP serialized;
+
+   if (!isCompressedBytes(RAW(payload), XLENGTH(payload))) {
+      return(payload);
+   }
+
+   PROTECT(payload);
+   serialized = decompressBytes(RAW(payload), XLENGTH(payload));
+   UNPROTECT(1);
+
+   return(serialized);
+}
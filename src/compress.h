@@ -0,0 +1,47 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef _compress_h
+#define _compress_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+
+/*
+ * A compressed payload starts with the two bytes "Z\n", followed by 
+ * the uncompressed length as 8 little-endian bytes and the zlib stream.
+ * Serialized R objects start with "X\n", "A\n" or "B\n", so payloads 
+ * that were not compressed are sent unchanged.
+ */
+#define COMPRESSION_MAGIC "Z\n"
+#define COMPRESSION_MAGIC_LENGTH 2
+#define COMPRESSION_HEADER_LENGTH (COMPRESSION_MAGIC_LENGTH + 8)
+
+// Compressed payloads larger than this fraction of the input are not sent.
+#define COMPRESSION_MAX_RATIO 0.9
+
+// Number of payloads sent uncompressed after compression did not pay off.
+#define COMPRESSION_BACKOFF 16
+
+void initCompression(SEXP compression);
+SEXP compressBytes(const unsigned char *bytes, R_xlen_t length);
+SEXP compressPayload(SEXP serialized);
+int isCompressedBytes(const unsigned char *bytes, R_xlen_t length);
+SEXP decompressBytes(const unsigned char *bytes, R_xlen_t length);
+SEXP decompressPayload(SEXP payload);
+
+#endif // _compress_h
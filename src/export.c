@@ -0,0 +1,185 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * Exported objects are broadcast once and kept by every process in an
+ * environment of exports whose parent is the global environment. The
+ * supervisor assigns the object it was given, without unserializing it.
+ * A function defined in the global environment is evaluated with the 
+ * exports as its enclosure on every process, so it finds them before 
+ * any global object of the same name, and the same way on the 
+ * supervisor as on the workers. Exports never touch the global
+ * environment.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <stdint.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply_helpers.h"
+#include "shared.h"
+#include "export.h"
+
+static SEXP exportEnvironment = NULL;
+
+/**
+   The environment holding the exported objects of a process.
+
+   It is created on the first export, as a child of the global
+   environment.
+
+   @return                 the environment of the exports
+*/
+static SEXP exports() {
+   if (exportEnvironment == NULL) {
+      exportEnvironment = R_NewEnv(R_GlobalEnv, TRUE, 29);
+      R_PreserveObject(exportEnvironment);
+   }
+
+   return(exportEnvironment);
+}
+
+/**
+   Let a function find the exported objects.
+
+   A closure defined in the global environment is copied with the
+   environment of the exports as its enclosure. Other functions, and
+   every function before the first export, are returned unchanged.
+
+   @param[in] theFunction  R function
+   @return                 R function (not protected)
+*/
+SEXP bindExports(SEXP theFunction) {
+   SEXP bindCall, bound;
+
+   if (exportEnvironment == NULL || TYPEOF(theFunction) != CLOSXP ||
+         CLOENV(theFunction) != R_GlobalEnv) {
+      return(theFunction);
+   }
+
+   PROTECT(theFunction);
+   PROTECT(bindCall = lang3(install("environment<-"), theFunction, 
+      exportEnvironment));
+   bound = eval(bindCall, R_BaseEnv);
+   UNPROTECT(2);
+
+   return(bound);
+}
+
+/**
+   Broadcast a serialized object from the supervisor to the workers.
+
+   @param[in] serialized   R raw vector storing the serialized object
+                           (supervisor only)
+   @return                 the unserialized object on the workers,
+                           R_NilValue on the supervisor (not protected)
+*/
+static SEXP broadcastObject(SEXP serialized) {
+   int64_t length = 0;
+
+   if (readonly_rank == 0) {
+      length = XLENGTH(serialized);
+   }
+
+   MPI_Bcast(&length, 1, MPI_INT64_T, 0, MPI_COMM_WORLD);
+
+   return(broadcastPayload(serialized, length));
+}
+
+/**
+   Assign an exported object in the environment of the exports.
+
+   The supervisor assigns the value it was given, and the workers
+   the value they unserialize.
+
+   @param[in] name              R character string (supervisor only)
+   @param[in] value             R object to export (supervisor only)
+   @param[in] serializeExport   R raw vector storing a serialized
+                                list(name, value) (supervisor only)
+*/
+static void assignExport(SEXP name, SEXP value, SEXP serializeExport) {
+   SEXP export;
+
+   PROTECT(export = broadcastObject(serializeExport));
+   if (readonly_rank > 0) {
+      name  = VECTOR_ELT(export, 0);
+      value = VECTOR_ELT(export, 1);
+   }
+   MARK_NOT_MUTABLE(value);
+   defineVar(install(CHAR(STRING_ELT(name, 0))), value, exports());
+   UNPROTECT(1);
+}
+
+/**
+   Remove exported objects from the environment of the exports.
+
+   @param[in] names             R character vector (supervisor only)
+   @param[in] serializeNames    R raw vector storing a serialized
+                                character vector (supervisor only)
+*/
+static void removeExports(SEXP names, SEXP serializeNames) {
+   SEXP received, removeCall, arguments;
+
+   PROTECT(received = broadcastObject(serializeNames));
+   if (readonly_rank > 0) {
+      names = received;
+   }
+   if (exportEnvironment == NULL) {
+      UNPROTECT(1);
+      return;
+   }
+
+   PROTECT(arguments = list2(names, exportEnvironment));
+   SET_TAG(arguments, install("list"));
+   SET_TAG(CDR(arguments), install("envir"));
+
+   PROTECT(removeCall = LCONS(install("rm"), arguments));
+   eval(removeCall, R_BaseEnv);
+   UNPROTECT(3);
+}
+
+
+SEXP exportPiebaldMPI(SEXP name, SEXP value, SEXP serializeExport) {
+   checkPiebaldInit();
+
+   sendCommand(EXPORT);
+   assignExport(name, value, serializeExport);
+
+   return(R_NilValue);
+}
+
+SEXP unexportPiebaldMPI(SEXP names, SEXP serializeNames) {
+   checkPiebaldInit();
+
+   sendCommand(UNEXPORT);
+   removeExports(names, serializeNames);
+
+   return(R_NilValue);
+}
+
+
+void exportWorkerPiebaldMPI() {
+   assignExport(R_NilValue, R_NilValue, R_NilValue);
+}
+
+void unexportWorkerPiebaldMPI() {
+   removeExports(R_NilValue, R_NilValue);
+}
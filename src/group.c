@@ -0,0 +1,135 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * A group is a subset of the processes, always including the supervisor,
+ * with its own communicator. Jobs sent to a group only occupy its 
+ * workers, so that jobs on disjoint groups run side by side.
+ * Every process numbers the groups in creation order, and a process
+ * outside a group stores MPI_COMM_NULL for it.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "group.h"
+
+static MPI_Comm *groupComms = NULL;
+static int numGroups = 0;
+
+/**
+   Split the communicator of a new group off every process.
+
+   @param[in,out] members  membership flag of every rank
+                           (significant on the supervisor only)
+   @return                 the communicator of the group, or 
+                           MPI_COMM_NULL outside the group
+*/
+static MPI_Comm splitGroup(int *members) {
+   MPI_Comm comm;
+
+   MPI_Bcast(members, readonly_nproc, MPI_INT, 0, MPI_COMM_WORLD);
+   MPI_Comm_split(MPI_COMM_WORLD, 
+      members[readonly_rank] ? 1 : MPI_UNDEFINED, readonly_rank, &comm);
+
+   groupComms = Realloc(groupComms, numGroups + 1, MPI_Comm);
+   groupComms[numGroups] = comm;
+   numGroups++;
+
+   return(comm);
+}
+
+/**
+   The communicator of a group.
+
+   The supervisor is rank 0 of every group.
+
+   @param[in] group        the group, 0 for every process
+   @return                 the communicator of the group, or
+                           MPI_COMM_NULL outside the group
+*/
+MPI_Comm groupComm(int group) {
+   if (group == 0) {
+      return(readonly_asyncComm);
+   }
+   if (group < 0 || group > numGroups) {
+      return(MPI_COMM_NULL);
+   }
+   return(groupComms[group - 1]);
+}
+
+/**
+   Free the communicators of every group.
+*/
+void freeGroups() {
+   int i;
+
+   for(i = 0; i < numGroups; i++) {
+      if (groupComms[i] != MPI_COMM_NULL) {
+         MPI_Comm_free(groupComms + i);
+      }
+   }
+   Free(groupComms);
+   numGroups = 0;
+}
+
+
+SEXP groupPiebaldMPI(SEXP ranks) {
+   checkPiebaldInit();
+
+   int i, rank;
+   int *members;
+   MPI_Comm comm;
+   SEXP group;
+
+   for(i = 0; i < LENGTH(ranks); i++) {
+      rank = INTEGER(ranks)[i];
+      if (rank == NA_INTEGER || rank < 0 || rank >= readonly_nproc) {
+         error("Invalid rank in a group.");
+      }
+   }
+
+   members = Calloc(readonly_nproc, int);
+   members[0] = TRUE;
+   for(i = 0; i < LENGTH(ranks); i++) {
+      members[INTEGER(ranks)[i]] = TRUE;
+   }
+
+   sendCommand(GROUP);
+
+   comm = splitGroup(members);
+   Free(members);
+
+   PROTECT(group = allocVector(INTSXP, 2));
+   INTEGER(group)[0] = numGroups;
+   MPI_Comm_size(comm, INTEGER(group) + 1);
+   UNPROTECT(1);
+
+   return(group);
+}
+
+
+void groupWorkerPiebaldMPI() {
+   int *members = Calloc(readonly_nproc, int);
+
+   splitGroup(members);
+   Free(members);
+}
@@ -0,0 +1,431 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * Two-level distribution of arguments and results.
+ *
+ * The supervisor sends each node leader a single bundle holding the
+ * payloads of every process on that node, and each leader forwards
+ * the payloads to the processes of its node. Results travel back
+ * the same way. The supervisor leads its own node, so it exchanges
+ * payloads directly with the processes of its node.
+ *
+ * A bundle is a table laid out as the integers { count, ranks[count] }
+ * and the 64-bit integers lengths[count], sent with TAG_NODE_BUNDLE,
+ * followed by every payload as it is, in the order of the table, sent
+ * with TAG_NODE_PAYLOAD. Payloads are never copied into the bundle.
+ * Other messages carry their own size, which the receiver reads with
+ * MPI_Probe(), so no separate round of lengths is needed.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "commands.h"
+#include "state.h"
+#include "lapply_helpers.h"
+#include "hierarchy.h"
+#include "bigcount.h"
+#include "profile.h"
+
+// World ranks of the processes of this node, by node rank.
+static int *nodeMembers = NULL;
+static int nodeSize = 0;
+
+// Supervisor: world ranks of the processes of every node, by leader.
+static int numLeaders = 0;
+static int *leaderNodeSizes = NULL;
+static int *leaderOffsets = NULL;
+static int *leaderMembers = NULL;
+
+/**
+   Learn the processes of every node.
+
+   Must be called after initSharedMemory().
+*/
+void initHierarchy() {
+   int i, total = 0;
+
+   MPI_Comm_size(readonly_nodeComm, &nodeSize);
+   nodeMembers = Calloc(nodeSize, int);
+   MPI_Allgather(&readonly_rank, 1, MPI_INT, nodeMembers, 1, MPI_INT,
+      readonly_nodeComm);
+
+   if (readonly_leaderComm == MPI_COMM_NULL) {
+      return;
+   }
+
+   MPI_Comm_size(readonly_leaderComm, &numLeaders);
+   if (readonly_rank == 0) {
+      leaderNodeSizes = Calloc(numLeaders, int);
+      leaderOffsets   = Calloc(numLeaders, int);
+   }
+
+   MPI_Gather(&nodeSize, 1, MPI_INT, leaderNodeSizes, 1, MPI_INT, 0,
+      readonly_leaderComm);
+
+   if (readonly_rank == 0) {
+      for(i = 0; i < numLeaders; i++) {
+         leaderOffsets[i] = total;
+         total += leaderNodeSizes[i];
+      }
+      leaderMembers = Calloc(total, int);
+   }
+
+   MPI_Gatherv(nodeMembers, nodeSize, MPI_INT, leaderMembers, 
+      leaderNodeSizes, leaderOffsets, MPI_INT, 0, readonly_leaderComm);
+}
+
+void freeHierarchy() {
+   Free(nodeMembers);
+   if (readonly_rank == 0) {
+      Free(leaderNodeSizes);
+      Free(leaderOffsets);
+      Free(leaderMembers);
+   }
+}
+
+/**
+   Receive a message whose size is not known in advance.
+
+   @param[in]  source      world rank of the sender, or MPI_ANY_SOURCE
+   @param[in]  tag         tag of the message, or MPI_ANY_TAG
+   @param[out] status      status of the message
+   @return                 R raw vector storing the message (not protected)
+*/
+static SEXP receiveProbed(int source, int tag, MPI_Status *status) {
+   R_xlen_t length;
+   SEXP message;
+
+   MPI_Probe(source, tag, MPI_COMM_WORLD, status);
+   length = probedLength(status);
+
+   message = allocVector(RAWSXP, length);
+   recvBytes(RAW(message), length, status->MPI_SOURCE, status->MPI_TAG, 
+      MPI_COMM_WORLD);
+
+   return(message);
+}
+
+/**
+   Pack the table of a bundle.
+
+   @param[in] payloads     R list of raw vectors indexed by world rank
+   @param[in] ranks        world ranks whose payloads are bundled
+   @param[in] count        number of ranks
+   @return                 R raw vector storing the table (not protected)
+*/
+static SEXP packBundleTable(SEXP payloads, int *ranks, int count) {
+   int i;
+   size_t offset = (1 + count) * sizeof(int);
+   int64_t length;
+   SEXP table;
+
+   table = allocVector(RAWSXP, offset + count * sizeof(int64_t));
+
+   memcpy(RAW(table), &count, sizeof(int));
+   memcpy(RAW(table) + sizeof(int), ranks, count * sizeof(int));
+   for(i = 0; i < count; i++) {
+      length = XLENGTH(VECTOR_ELT(payloads, ranks[i]));
+      memcpy(RAW(table) + offset + i * sizeof(int64_t), &length, 
+         sizeof(int64_t));
+   }
+
+   return(table);
+}
+
+/**
+   Start sending a bundle: its table, then every payload in place.
+
+   The table and the payloads must remain protected until the
+   requests have completed.
+
+   @param[in]  table       R raw vector storing the table of the bundle
+   @param[in]  payloads    R list of raw vectors indexed by world rank
+   @param[in]  ranks       world ranks whose payloads are bundled
+   @param[in]  count       number of ranks
+   @param[in]  destination world rank of the receiver
+   @param[out] requests    count + 1 MPI requests
+   @return                 number of requests started
+*/
+static int isendBundle(SEXP table, SEXP payloads, int *ranks, int count,
+   int destination, MPI_Request *requests) {
+
+   int i;
+   SEXP payload;
+
+   isendBytes(RAW(table), XLENGTH(table), destination, TAG_NODE_BUNDLE,
+      MPI_COMM_WORLD, requests);
+   for(i = 0; i < count; i++) {
+      payload = VECTOR_ELT(payloads, ranks[i]);
+      isendBytes(RAW(payload), XLENGTH(payload), destination, 
+         TAG_NODE_PAYLOAD, MPI_COMM_WORLD, requests + 1 + i);
+   }
+
+   return(count + 1);
+}
+
+/**
+   Receive the table of a bundle.
+
+   @param[in]  source      world rank of the sender
+   @param[out] ranks       world rank of every payload
+   @param[out] lengths     byte count of every payload
+   @return                 number of payloads that follow
+*/
+static int receiveBundleTable(int source, int *ranks, int64_t *lengths) {
+   int count;
+   MPI_Status status;
+   SEXP table;
+
+   PROTECT(table = receiveProbed(source, TAG_NODE_BUNDLE, &status));
+
+   memcpy(&count, RAW(table), sizeof(int));
+   memcpy(ranks, RAW(table) + sizeof(int), count * sizeof(int));
+   memcpy(lengths, RAW(table) + (1 + count) * sizeof(int), 
+      count * sizeof(int64_t));
+   UNPROTECT(1);
+
+   return(count);
+}
+
+/**
+   Receive the next payload of a bundle.
+
+   @param[in] source       world rank of the sender
+   @param[in] length       byte count of the payload, from the table
+   @return                 R raw vector storing the payload (not protected)
+*/
+static SEXP receiveBundlePayload(int source, int64_t length) {
+   SEXP payload;
+
+   payload = allocVector(RAWSXP, length);
+   recvBytes(RAW(payload), length, source, TAG_NODE_PAYLOAD, 
+      MPI_COMM_WORLD);
+
+   return(payload);
+}
+
+/**
+   Send the serialized arguments to the workers through the node leaders.
+
+   @param[in] serializeArgs  R list of raw vectors, one per process
+*/
+void hierarchicalSendArgs(SEXP serializeArgs) {
+   int i, numRequests = 0;
+   SEXP tables;
+   MPI_Request *requests = Calloc(nodeSize + numLeaders + readonly_nproc,
+      MPI_Request);
+
+   PROTECT(tables = allocVector(VECSXP, numLeaders));
+
+   for(i = 1; i < nodeSize; i++) {
+      isendBytes(RAW(VECTOR_ELT(serializeArgs, nodeMembers[i])),
+         XLENGTH(VECTOR_ELT(serializeArgs, nodeMembers[i])), 
+         nodeMembers[i], TAG_NODE_ARGS, MPI_COMM_WORLD, 
+         requests + numRequests++);
+      profileBytes(PROFILE_SCATTER, 
+         XLENGTH(VECTOR_ELT(serializeArgs, nodeMembers[i])));
+   }
+
+   for(i = 1; i < numLeaders; i++) {
+      SET_VECTOR_ELT(tables, i, packBundleTable(serializeArgs, 
+         leaderMembers + leaderOffsets[i], leaderNodeSizes[i]));
+      numRequests += isendBundle(VECTOR_ELT(tables, i), serializeArgs,
+         leaderMembers + leaderOffsets[i], leaderNodeSizes[i],
+         leaderMembers[leaderOffsets[i]], requests + numRequests);
+   }
+
+   MPI_Waitall(numRequests, requests, MPI_STATUSES_IGNORE);
+
+   UNPROTECT(1);
+   Free(requests);
+}
+
+/**
+   Receive the arguments of this worker through its node leader.
+
+   A node leader first forwards the payloads of the other processes
+   of its node, then unserializes its own payload from the bundle.
+
+   @return  R list of arguments to lapply (not protected)
+*/
+SEXP workerHierarchicalReceiveArgs() {
+   int i, count;
+   int *ranks;
+   int64_t *lengths;
+   MPI_Status status;
+   MPI_Request *requests;
+   SEXP payloads, args;
+
+   if (readonly_nodeRank > 0) {
+      PROTECT(args = receiveProbed(nodeMembers[0], TAG_NODE_ARGS, 
+         &status));
+      profileBytes(PROFILE_SCATTER, XLENGTH(args));
+      args = unserializeRaw(args);
+      UNPROTECT(1);
+      return(args);
+   }
+
+   ranks    = Calloc(nodeSize, int);
+   lengths  = Calloc(nodeSize, int64_t);
+   requests = Calloc(nodeSize, MPI_Request);
+
+   count = receiveBundleTable(0, ranks, lengths);
+   PROTECT(payloads = allocVector(VECSXP, count));
+
+   requests[0] = MPI_REQUEST_NULL;
+   for(i = 0; i < count; i++) {
+      SET_VECTOR_ELT(payloads, i, receiveBundlePayload(0, lengths[i]));
+      profileBytes(PROFILE_SCATTER, lengths[i]);
+      if (i > 0) {
+         isendBytes(RAW(VECTOR_ELT(payloads, i)), lengths[i], ranks[i],
+            TAG_NODE_ARGS, MPI_COMM_WORLD, requests + i);
+      }
+   }
+
+   PROTECT(args = unserializeRaw(VECTOR_ELT(payloads, 0)));
+
+   MPI_Waitall(count, requests, MPI_STATUSES_IGNORE);
+   UNPROTECT(2);
+
+   Free(ranks);
+   Free(lengths);
+   Free(requests);
+
+   return(args);
+}
+
+/**
+   Send the results of this worker back through its node leader.
+
+   A node leader collects the results of the other processes of 
+   its node and sends them to the supervisor in a single bundle.
+
+   @param[in] serialResults  R raw vector storing the serialized results
+*/
+void workerHierarchicalSendResults(SEXP serialResults) {
+   int i;
+   MPI_Status status;
+   MPI_Request *requests;
+   SEXP results, table;
+
+   if (readonly_nodeRank > 0) {
+      sendBytes(RAW(serialResults), XLENGTH(serialResults), 
+         nodeMembers[0], TAG_NODE_RESULTS, MPI_COMM_WORLD);
+      return;
+   }
+
+   PROTECT(results = allocVector(VECSXP, readonly_nproc));
+   SET_VECTOR_ELT(results, readonly_rank, serialResults);
+
+   for(i = 1; i < nodeSize; i++) {
+      SET_VECTOR_ELT(results, nodeMembers[i], 
+         receiveProbed(nodeMembers[i], TAG_NODE_RESULTS, &status));
+   }
+
+   PROTECT(table = packBundleTable(results, nodeMembers, nodeSize));
+   requests = Calloc(nodeSize + 1, MPI_Request);
+   MPI_Waitall(isendBundle(table, results, nodeMembers, nodeSize, 0, 
+      requests), requests, MPI_STATUSES_IGNORE);
+   Free(requests);
+
+   UNPROTECT(2);
+}
+
+/**
+   Receive the results of the workers through the node leaders.
+
+   The results of the processes of the supervisor's node arrive
+   directly, the others in one bundle per node. Only the expected 
+   sources and tags are probed, so that other traffic, such as
+   asynchronous jobs, is never taken for a result. Messages are 
+   handled in the order they arrive, and each result is unserialized 
+   as soon as it has been received.
+
+   @param[out] workerResultsList   R list of results indexed by world rank
+*/
+void hierarchicalReceiveResults(SEXP workerResultsList) {
+   int i, j, count, next, arrived;
+   int messages = (nodeSize - 1) + (numLeaders - 1);
+   int *sources      = Calloc(messages + 1, int);
+   int *tags         = Calloc(messages + 1, int);
+   int *received     = Calloc(messages + 1, int);
+   int *ranks        = Calloc(readonly_nproc, int);
+   int64_t *lengths  = Calloc(readonly_nproc, int64_t);
+   MPI_Status status;
+   SEXP message;
+
+   for(i = 1; i < nodeSize; i++) {
+      sources[i - 1] = nodeMembers[i];
+      tags[i - 1]    = TAG_NODE_RESULTS;
+   }
+   for(i = 1; i < numLeaders; i++) {
+      sources[nodeSize - 2 + i] = leaderMembers[leaderOffsets[i]];
+      tags[nodeSize - 2 + i]    = TAG_NODE_BUNDLE;
+   }
+
+   for(i = 0; i < messages; i++) {
+      // Take a message that has arrived, or else wait for the first 
+      // message still expected.
+      next = -1;
+      for(j = 0; j < messages && next < 0; j++) {
+         if (!received[j]) {
+            MPI_Iprobe(sources[j], tags[j], MPI_COMM_WORLD, &arrived, 
+               MPI_STATUS_IGNORE);
+            if (arrived) {
+               next = j;
+            }
+         }
+      }
+      for(j = 0; next < 0; j++) {
+         if (!received[j]) {
+            next = j;
+         }
+      }
+      received[next] = TRUE;
+
+      if (tags[next] == TAG_NODE_RESULTS) {
+         PROTECT(message = receiveProbed(sources[next], TAG_NODE_RESULTS,
+            &status));
+         profileBytes(PROFILE_GATHER, XLENGTH(message));
+         SET_VECTOR_ELT(workerResultsList, sources[next], 
+            unserializeRaw(message));
+         UNPROTECT(1);
+         continue;
+      }
+
+      count = receiveBundleTable(sources[next], ranks, lengths);
+      for(j = 0; j < count; j++) {
+         PROTECT(message = receiveBundlePayload(sources[next], 
+            lengths[j]));
+         profileBytes(PROFILE_GATHER, lengths[j]);
+         SET_VECTOR_ELT(workerResultsList, ranks[j], 
+            unserializeRaw(message));
+         UNPROTECT(1);
+      }
+   }
+
+   Free(sources);
+   Free(tags);
+   Free(received);
+   Free(ranks);
+   Free(lengths);
+}
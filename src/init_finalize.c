@@ -18,27 +18,67 @@
 #include "commands.h"
 #include "state.h"
 #include "lapply.h"
+#include "lapply_dynamic.h"
+#include "lapply_dynamic_helpers.h"
+#include "lapply_pipelined.h"
+#include "vapply.h"
+#include "lapply_async.h"
+#include "mapreduce.h"
+#include "profile.h"
+#include "lapply_async_helpers.h"
+#include "cache.h"
+#include "compress.h"
+#include "export.h"
+#include "shared.h"
+#include "hierarchy.h"
+#include "group.h"
+#include "serialize.h"
+#include "pool.h"
+#include "resident.h"
+#include "mapply.h"
+#include "apply.h"
 #include <mpi.h>
 
 int readonly_rank, readonly_nproc;
 int readonly_initialized = 0;
 
-SEXP readonly_serialize = NULL;
-SEXP readonly_unserialize = NULL;
+MPI_Comm readonly_asyncComm = MPI_COMM_NULL;
+MPI_Comm readonly_nodeComm = MPI_COMM_NULL;
+MPI_Comm readonly_leaderComm = MPI_COMM_NULL;
+int readonly_nodeRank = 0;
+int readonly_hierarchical = FALSE;
+
 SEXP readonly_lapply = NULL;
+SEXP readonly_vapply = NULL;
+SEXP readonly_reduce = NULL;
+SEXP readonly_mapply = NULL;
 
-SEXP initPiebaldMPI() {
+SEXP initPiebaldMPI(SEXP cacheSize, SEXP localLapply, SEXP compression,
+      SEXP hierarchical, SEXP bufferLimit) {
    if(readonly_initialized == TRUE) {
       error("The function pbmpi_init() has already been called.");
    }
 
-   readonly_serialize   = findVar(install("serialize"), R_GlobalEnv);
-   readonly_unserialize = findVar(install("unserialize"), R_GlobalEnv);
-   readonly_lapply      = findVar(install("lapply"), R_GlobalEnv);
+   readonly_lapply      = localLapply;
+   // Taken from base, so that user code cannot mask them.
+   readonly_vapply      = findVar(install("vapply"), R_BaseNamespace);
+   readonly_reduce      = findVar(install("Reduce"), R_BaseNamespace);
+   readonly_mapply      = findVar(install("mapply"), R_BaseNamespace);
+
+   R_PreserveObject(readonly_lapply);
+
+   initObjectCache(asReal(cacheSize));
+   initCompression(compression);
 
    MPI_Init(NULL, NULL);
    MPI_Comm_size( MPI_COMM_WORLD, &readonly_nproc );
    MPI_Comm_rank( MPI_COMM_WORLD, &readonly_rank );   
+   initBufferPool(asReal(bufferLimit));
+   MPI_Comm_dup( MPI_COMM_WORLD, &readonly_asyncComm );
+   initSerialization();
+   initSharedMemory();
+   initHierarchy();
+   readonly_hierarchical = asLogical(hierarchical);
 
    readonly_initialized = TRUE;
 
@@ -46,11 +86,38 @@ SEXP initPiebaldMPI() {
       return(R_NilValue);
    } else {
       int done = FALSE;
-      int command;
+      int command, group;
+      MPI_Request commandRequest = MPI_REQUEST_NULL;
+      MPI_Request groupRequest = MPI_REQUEST_NULL;
       while(done == FALSE) {
-         MPI_Bcast(&command, 1, MPI_INT, 0, MPI_COMM_WORLD);
+         // Group jobs are sent to the workers of the group only, so 
+         // they are received apart from the command broadcast.
+         if (commandRequest == MPI_REQUEST_NULL) {
+            MPI_Ibcast(&command, 1, MPI_INT, 0, MPI_COMM_WORLD, 
+               &commandRequest);
+         }
+         if (groupRequest == MPI_REQUEST_NULL) {
+            MPI_Irecv(&group, 1, MPI_INT, 0, TAG_GROUP_JOB, 
+               readonly_asyncComm, &groupRequest);
+         }
+         if (waitForCommand(&commandRequest, &groupRequest)) {
+            profileIdle();
+            lapplyAsyncWorkerPiebaldMPI(groupComm(group));
+            continue;
+         }
+         profileIdle();
          switch(command) {
             case TERMINATE:
+               MPI_Cancel(&groupRequest);
+               MPI_Wait(&groupRequest, MPI_STATUS_IGNORE);
+               completeDeferredSends();
+               clearObjectCache();
+               clearResidentData();
+               freeBufferPool();
+               freeGroups();
+               MPI_Comm_free(&readonly_asyncComm);
+               freeHierarchy();
+               freeSharedMemory();
                MPI_Finalize();
 
                done = TRUE;
@@ -58,6 +125,57 @@ SEXP initPiebaldMPI() {
             case LAPPLY:
                lapplyWorkerPiebaldMPI();
                break;
+            case LAPPLY_DYNAMIC:
+               lapplyDynamicWorkerPiebaldMPI();
+               break;
+            case LAPPLY_PIPELINED:
+               lapplyPipelinedWorkerPiebaldMPI();
+               break;
+            case VAPPLY:
+               vapplyWorkerPiebaldMPI();
+               break;
+            case LAPPLY_ASYNC:
+               lapplyAsyncWorkerPiebaldMPI(readonly_asyncComm);
+               break;
+            case MAP_REDUCE:
+               mapReduceWorkerPiebaldMPI();
+               break;
+            case PROFILE:
+               profileWorkerPiebaldMPI();
+               break;
+            case EXPORT:
+               exportWorkerPiebaldMPI();
+               break;
+            case UNEXPORT:
+               unexportWorkerPiebaldMPI();
+               break;
+            case GROUP:
+               groupWorkerPiebaldMPI();
+               break;
+            case DISTRIBUTE:
+               distributeWorkerPiebaldMPI();
+               break;
+            case LAPPLY_RESIDENT:
+               lapplyResidentWorkerPiebaldMPI();
+               break;
+            case COLLECT:
+               collectWorkerPiebaldMPI();
+               break;
+            case FREE_RESIDENT:
+               freeResidentWorkerPiebaldMPI();
+               break;
+            case MAPPLY:
+               mapplyWorkerPiebaldMPI();
+               break;
+            case APPLY:
+               applyWorkerPiebaldMPI();
+               break;
+            case TRIM_BUFFERS:
+               trimBufferPool();
+               break;
+            case CLEAR_CACHE:
+               clearObjectCache();
+               break;
             default:
                break;
          }
@@ -66,6 +184,26 @@ SEXP initPiebaldMPI() {
    return(R_NilValue);
 }
 
+/**
+   Broadcast a command from the supervisor to the worker processes.
+
+   The broadcast is nonblocking so that it matches the broadcast
+   posted by the workers while they complete the sends of
+   asynchronous jobs. Nonblocking and blocking collective operations
+   never match each other. Workers still running a losing speculative
+   copy are drained first, as they block until their result is received.
+
+   @param[in] command      the command to broadcast
+*/
+void sendCommand(int command) {
+   MPI_Request request;
+
+   drainDynamicSchedule();
+   profileIdle();
+   MPI_Ibcast(&command, 1, MPI_INT, 0, MPI_COMM_WORLD, &request);
+   MPI_Wait(&request, MPI_STATUS_IGNORE);
+}
+
 void checkPiebaldInit() {
    if(readonly_initialized == FALSE) {
       error("The function pbmpi_init() must be invoked before this function can be called.");
@@ -77,9 +215,16 @@ SEXP finalizePiebaldMPI() {
    checkPiebaldInit();
 
    if (readonly_rank == 0) {
-      int command = TERMINATE;
-      MPI_Bcast(&command, 1, MPI_INT, 0, MPI_COMM_WORLD);
+      drainAsyncJobs();
+      sendCommand(TERMINATE);
    }
+   clearObjectCache();
+   clearResidentData();
+   freeBufferPool();
+   freeGroups();
+   MPI_Comm_free(&readonly_asyncComm);
+   freeHierarchy();
+   freeSharedMemory();
    MPI_Finalize();
 
    readonly_initialized = FALSE;   
@@ -7,7 +7,9 @@
 
 
 void checkPiebaldInit();
-SEXP initPiebaldMPI();
+void sendCommand(int command);
+SEXP initPiebaldMPI(SEXP cacheSize, SEXP localLapply, SEXP compression,
+   SEXP hierarchical, SEXP bufferLimit);
 SEXP finalizePiebaldMPI();
 
 
@@ -24,76 +24,97 @@
 #include "commands.h"
 #include "state.h"
 #include "lapply_helpers.h"
+#include "typed.h"
+#include "hierarchy.h"
+#include "profile.h"
+#include "pool.h"
 
 
-void lapplyPiebaldMPI_doSend(SEXP serializeFun, SEXP serializeArgs, 
-   SEXP serializeRemainder) {
+void lapplyPiebaldMPI_doSend(SEXP args, SEXP argBase, SEXP argCount) {
 
-   int totalLength = 0;
-   int *lengths        = Calloc(readonly_nproc, int);
-   int *displacements  = Calloc(readonly_nproc, int);
+   int encoding = argumentEncoding(args);
+   int phase = profileEnter(PROFILE_SCATTER);
 
-   int command = LAPPLY;
-   MPI_Bcast(&command, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   MPI_Bcast(&encoding, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-   sendFunction(serializeFun);
+   if (encoding != RAWSXP) {
+      sendTypedArgs(args, argBase, argCount);
+      profileLeave(phase);
+      return;
+   }
 
-   sendRemainder(serializeRemainder);
+   if (readonly_hierarchical) {
+      hierarchicalSendArgs(args);
+      profileLeave(phase);
+      return;
+   }
 
-   sendRawByteCounts(lengths, serializeArgs, &totalLength);
+   int64_t *lengths    = poolCounts();
 
-   generateRawByteDisplacements(displacements, lengths);
+   sendRawByteCounts(lengths, args);
    
-   sendArgRawBytes(displacements, lengths, totalLength, serializeArgs);
-
-   Free(lengths);
-   Free(displacements);
+   sendArgRawBytes(lengths, args);
 
+   profileLeave(phase);
 }
 
 void lapplyPiebaldMPI_doReceive(SEXP workerResultsList, SEXP returnList) {
 
-   int *lengths       = Calloc(readonly_nproc, int);
-   int *displacements = Calloc(readonly_nproc, int);
+   int phase = profileEnter(PROFILE_GATHER);
+
+   if (readonly_hierarchical) {
+      hierarchicalReceiveResults(workerResultsList);
+      concatenateResults(workerResultsList, returnList);
+      profileLeave(phase);
+      return;
+   }
 
-   int totalIncomingLength = 0;
+   int64_t *lengths      = poolCounts();
+   MPI_Request *requests = poolRequests();
    unsigned char *buffer;
+   R_xlen_t total;
 
-   receiveIncomingLengths(lengths, displacements, &totalIncomingLength);
+   total = receiveIncomingLengths(lengths);
 
-   buffer = Calloc(totalIncomingLength, unsigned char);
+   buffer = poolBuffer(POOL_RECEIVE, total);
 
-   receiveIncomingData(buffer, lengths, displacements);
+   receiveIncomingData(buffer, lengths, requests);
  
-   processIncomingData(buffer, lengths, workerResultsList, returnList);
+   processIncomingData(buffer, lengths, requests, workerResultsList, 
+      returnList);
 
-   Free(lengths);
-   Free(displacements);
-   Free(buffer);
+   releasePoolBuffer(POOL_RECEIVE);
 
+   profileLeave(phase);
 }
 
 
-SEXP lapplyPiebaldMPI(SEXP serializeFun, SEXP serializeArgs, 
-      SEXP serializeRemainder, SEXP argLength) {
+SEXP lapplyPiebaldMPI(SEXP serializeFun, SEXP args, 
+      SEXP serializeRemainder, SEXP argBase, SEXP argCount) {
 
    checkPiebaldInit();
 
-   int length = INTEGER(argLength)[0];
+   int length = sumCounts(argCount);
    SEXP workerResultsList, returnList;
+   SEXP theFunction, remainder;
 
    PROTECT(workerResultsList = allocVector(VECSXP, readonly_nproc));
    PROTECT(returnList = allocVector(VECSXP, length));
 
-   lapplyPiebaldMPI_doSend(serializeFun, serializeArgs, serializeRemainder);
+   sendCommand(LAPPLY);
+
+   PROTECT(theFunction = sendFunction(serializeFun));
 
-   evaluateLocalWork(serializeFun, serializeArgs, serializeRemainder, 
+   PROTECT(remainder = sendRemainder(serializeRemainder));
+
+   lapplyPiebaldMPI_doSend(args, argBase, argCount);
+
+   evaluateLocalWork(theFunction, args, argBase, argCount, remainder, 
       workerResultsList);
 
    lapplyPiebaldMPI_doReceive(workerResultsList, returnList);
 
-   UNPROTECT(2);
+   UNPROTECT(4);
 
    return(returnList);
 }
-
@@ -23,8 +23,11 @@
 #include <R_ext/Rdynload.h>
 
 
-SEXP lapplyPiebaldMPI(SEXP functionName, SEXP serializeArgs, 
-      SEXP serializeRemainder, SEXP argLength);
+SEXP lapplyPiebaldMPI(SEXP serializeFun, SEXP args, 
+      SEXP serializeRemainder, SEXP argBase, SEXP argCount);
+
+void lapplyPiebaldMPI_doSend(SEXP args, SEXP argBase, SEXP argCount);
+void lapplyPiebaldMPI_doReceive(SEXP workerResultsList, SEXP returnList);
 
 void lapplyWorkerPiebaldMPI();
 
@@ -0,0 +1,114 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply_helpers.h"
+#include "export.h"
+#include "lapply_async_helpers.h"
+#include "lapply_async.h"
+
+
+static void asyncHandleFinalizer(SEXP handle) {
+   AsyncJob *job = (AsyncJob *) R_ExternalPtrAddr(handle);
+
+   if (job != NULL) {
+      releaseAsyncJob(job);
+      R_ClearExternalPtr(handle);
+   }
+}
+
+static AsyncJob *handleAsyncJob(SEXP handle) {
+   AsyncJob *job;
+
+   if (TYPEOF(handle) != EXTPTRSXP || 
+      (job = (AsyncJob *) R_ExternalPtrAddr(handle)) == NULL) {
+      error("Invalid handle of an asynchronous job.");
+   }
+   return(job);
+}
+
+
+SEXP lapplyAsyncPiebaldMPI(SEXP serializeFun, SEXP serializeArgs, 
+      SEXP serializeRemainder, SEXP argLength, SEXP group) {
+
+   checkPiebaldInit();
+
+   AsyncJob *job;
+   SEXP handle;
+
+   job = newAsyncJob(serializeFun, serializeArgs, serializeRemainder, 
+      asInteger(argLength), asInteger(group));
+
+   PROTECT(handle = R_MakeExternalPtr(job, R_NilValue, job->buffers));
+   R_RegisterCFinalizerEx(handle, asyncHandleFinalizer, FALSE);
+
+   startAsyncJob(job);
+
+   evaluateAsyncLocalWork(job);
+
+   UNPROTECT(1);
+
+   return(handle);
+}
+
+SEXP pollAsyncPiebaldMPI(SEXP handle) {
+   checkPiebaldInit();
+
+   return(ScalarLogical(progressAsyncJob(handleAsyncJob(handle), FALSE)));
+}
+
+SEXP waitAsyncPiebaldMPI(SEXP handle) {
+   checkPiebaldInit();
+
+   AsyncJob *job = handleAsyncJob(handle);
+
+   progressAsyncJob(job, TRUE);
+
+   return(VECTOR_ELT(job->buffers, ASYNC_RETURN_LIST));
+}
+
+
+void lapplyAsyncWorkerPiebaldMPI(MPI_Comm comm) {
+   int64_t header[ASYNC_HEADER_LENGTH];
+   SEXP payloads, theFunction, remainder, args, results;
+
+   PROTECT(payloads = workerReceiveAsyncJob(header, comm));
+
+   PROTECT(theFunction = bindExports(unserializeRaw(VECTOR_ELT(payloads, 
+      ASYNC_FUN))));
+
+   PROTECT(remainder = unserializeRaw(VECTOR_ELT(payloads, 
+      ASYNC_REMAINDER)));
+
+   PROTECT(args = unserializeRaw(VECTOR_ELT(payloads, ASYNC_ARGS)));
+
+   PROTECT(results = callLapply(args, theFunction, remainder));
+
+   results = serializeObject(results);
+   UNPROTECT(1);
+   PROTECT(results);
+
+   workerDeferResults((int) header[0], results, comm);
+
+   UNPROTECT(5);
+}
@@ -0,0 +1,470 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "commands.h"
+#include "state.h"
+#include "lapply_helpers.h"
+#include "export.h"
+#include "lapply_async_helpers.h"
+#include "lapply_dynamic_helpers.h"
+#include "group.h"
+#include "bigcount.h"
+
+// Supervisor: the jobs that have not completed yet.
+static AsyncJob *asyncJobs = NULL;
+static int asyncJobCounter = 0;
+
+// Worker: the result messages that have not completed yet.
+static MPI_Request *deferredRequests = NULL;
+static SEXP *deferredBuffers = NULL;
+static int numDeferred = 0;
+static int deferredCapacity = 0;
+
+/**
+   Create an asynchronous job and register it as in flight.
+
+   The buffers of the job are preserved until the job completes,
+   even if the handle of the job is garbage collected.
+
+   @param[in] serializeFun        R serialized function
+   @param[in] serializeArgs       R list of serialized arguments, one per rank
+   @param[in] serializeRemainder  R serialized list of "..." arguments
+   @param[in] length              total number of tasks
+   @param[in] group               group running the job, 0 for every process
+   @return                        the new job
+*/
+AsyncJob *newAsyncJob(SEXP serializeFun, SEXP serializeArgs, 
+   SEXP serializeRemainder, int length, int group) {
+
+   int i;
+   SEXP buffers;
+   AsyncJob *job = Calloc(1, AsyncJob);
+
+   job->command       = LAPPLY_ASYNC;
+   job->group         = group;
+   job->comm          = groupComm(group);
+   MPI_Comm_size(job->comm, &job->nproc);
+   job->tag           = TAG_ASYNC_JOB + 1 + 
+                        2 * (asyncJobCounter % ASYNC_JOB_TAGS);
+   job->length        = length;
+   job->headers       = Calloc(ASYNC_HEADER_LENGTH * job->nproc, 
+                           int64_t);
+   job->resultLengths = Calloc(job->nproc, int64_t);
+   job->states        = Calloc(job->nproc, int);
+   job->sendRequests  = Calloc(ASYNC_HEADER_LENGTH * job->nproc, 
+                           MPI_Request);
+   job->recvRequests  = Calloc(job->nproc, MPI_Request);
+   job->noticeRequests = Calloc(job->nproc, MPI_Request);
+   job->commandRequest = MPI_REQUEST_NULL;
+   asyncJobCounter++;
+
+   for(i = 0; i < ASYNC_HEADER_LENGTH * job->nproc; i++) {
+      job->sendRequests[i] = MPI_REQUEST_NULL;
+   }
+   for(i = 0; i < job->nproc; i++) {
+      job->recvRequests[i] = MPI_REQUEST_NULL;
+      job->noticeRequests[i] = MPI_REQUEST_NULL;
+      job->states[i] = ASYNC_WAIT_LENGTH;
+   }
+   job->states[0] = ASYNC_RECEIVED;
+
+   PROTECT(buffers = allocVector(VECSXP, ASYNC_BUFFERS));
+   SET_VECTOR_ELT(buffers, ASYNC_FUN, serializeFun);
+   SET_VECTOR_ELT(buffers, ASYNC_REMAINDER, serializeRemainder);
+   SET_VECTOR_ELT(buffers, ASYNC_ARGS, serializeArgs);
+   SET_VECTOR_ELT(buffers, ASYNC_WORKER_RESULTS, 
+      allocVector(VECSXP, job->nproc));
+   SET_VECTOR_ELT(buffers, ASYNC_SERIAL_RESULTS, 
+      allocVector(VECSXP, job->nproc));
+   R_PreserveObject(buffers);
+   UNPROTECT(1);
+
+   job->buffers = buffers;
+   job->next = asyncJobs;
+   asyncJobs = job;
+
+   return(job);
+}
+
+/**
+   Release the resources of a completed job.
+
+   Only the list of results is kept, and it is kept alive 
+   by the handle of the job from now on.
+
+   @param[in] job          the completed job
+*/
+static void finishAsyncJob(AsyncJob *job) {
+   AsyncJob **link;
+   int i;
+
+   for(link = &asyncJobs; *link != NULL; link = &(*link)->next) {
+      if (*link == job) {
+         *link = job->next;
+         break;
+      }
+   }
+
+   for(i = 0; i < ASYNC_RETURN_LIST; i++) {
+      SET_VECTOR_ELT(job->buffers, i, R_NilValue);
+   }
+   R_ReleaseObject(job->buffers);
+
+   Free(job->headers);
+   Free(job->resultLengths);
+   Free(job->states);
+   Free(job->sendRequests);
+   Free(job->recvRequests);
+   Free(job->noticeRequests);
+
+   job->done = TRUE;
+   if (job->released) {
+      Free(job);
+   }
+}
+
+/**
+   Send the group of a job to each of its workers.
+
+   The workers of a group are found by translating the ranks of the 
+   group communicator into ranks of readonly_asyncComm.
+
+   @param[in] job          the new job, for a group other than 0
+*/
+static void announceGroupJob(AsyncJob *job) {
+   int i;
+   int *ranks, *worldRanks;
+   MPI_Group jobGroup, worldGroup;
+
+   ranks      = Calloc(job->nproc, int);
+   worldRanks = Calloc(job->nproc, int);
+   for(i = 0; i < job->nproc; i++) {
+      ranks[i] = i;
+   }
+
+   MPI_Comm_group(job->comm, &jobGroup);
+   MPI_Comm_group(readonly_asyncComm, &worldGroup);
+   MPI_Group_translate_ranks(jobGroup, job->nproc, ranks, worldGroup, 
+      worldRanks);
+   MPI_Group_free(&jobGroup);
+   MPI_Group_free(&worldGroup);
+
+   for(i = 1; i < job->nproc; i++) {
+      MPI_Isend(&job->group, 1, MPI_INT, worldRanks[i], TAG_GROUP_JOB,
+         readonly_asyncComm, job->noticeRequests + i);
+   }
+
+   Free(ranks);
+   Free(worldRanks);
+}
+
+/**
+   Announce a job to the workers and post the receives of its results.
+
+   Nothing here waits for the workers: the function, the remainder
+   and the arguments are sent with nonblocking sends from the buffers
+   of the job.
+
+   @param[in] job          the new job
+*/
+void startAsyncJob(AsyncJob *job) {
+   int i;
+   int64_t *header;
+   MPI_Request *requests;
+   SEXP serializeFun       = VECTOR_ELT(job->buffers, ASYNC_FUN);
+   SEXP serializeRemainder = VECTOR_ELT(job->buffers, ASYNC_REMAINDER);
+   SEXP serializeArgs;
+
+   drainDynamicSchedule();
+   if (job->group == 0) {
+      MPI_Ibcast(&job->command, 1, MPI_INT, 0, MPI_COMM_WORLD, 
+         &job->commandRequest);
+   } else {
+      announceGroupJob(job);
+   }
+
+   for(i = 1; i < job->nproc; i++) {
+      serializeArgs = VECTOR_ELT(VECTOR_ELT(job->buffers, ASYNC_ARGS), i);
+      header   = job->headers + ASYNC_HEADER_LENGTH * i;
+      requests = job->sendRequests + ASYNC_HEADER_LENGTH * i;
+
+      header[0] = job->tag;
+      header[1] = XLENGTH(serializeFun);
+      header[2] = XLENGTH(serializeRemainder);
+      header[3] = XLENGTH(serializeArgs);
+
+      MPI_Isend(header, ASYNC_HEADER_LENGTH, MPI_INT64_T, i, 
+         TAG_ASYNC_JOB, job->comm, requests);
+      isendBytes(RAW(serializeFun), header[1], i, job->tag, 
+         job->comm, requests + 1);
+      isendBytes(RAW(serializeRemainder), header[2], i, job->tag,
+         job->comm, requests + 2);
+      isendBytes(RAW(serializeArgs), header[3], i, job->tag, 
+         job->comm, requests + 3);
+
+      MPI_Irecv(job->resultLengths + i, 1, MPI_INT64_T, i, job->tag, 
+         job->comm, job->recvRequests + i);
+   }
+}
+
+/**
+   The supervisor processes its share of a job.
+
+   @param[in] job          the job, after it has been started
+*/
+void evaluateAsyncLocalWork(AsyncJob *job) {
+   SEXP theFunction, remainder, args;
+   SEXP workerResultsList = VECTOR_ELT(job->buffers, ASYNC_WORKER_RESULTS);
+
+   PROTECT(theFunction = bindExports(unserializeRaw(VECTOR_ELT(job->buffers, 
+      ASYNC_FUN))));
+   PROTECT(remainder = unserializeRaw(VECTOR_ELT(job->buffers, 
+      ASYNC_REMAINDER)));
+   PROTECT(args = unserializeRaw(VECTOR_ELT(VECTOR_ELT(job->buffers, 
+      ASYNC_ARGS), 0)));
+
+   SET_VECTOR_ELT(workerResultsList, 0, 
+      callLapply(args, theFunction, remainder));
+
+   UNPROTECT(3);
+}
+
+/**
+   Receive the results of a job that have arrived.
+
+   The byte count of the results of a worker is received first, 
+   then the results themselves directly into a new R raw vector,
+   which is unserialized as soon as it is complete.
+
+   @param[in] job          the job
+   @param[in] wait         if TRUE, block until the job completes
+   @return                 TRUE if the job has completed
+*/
+int progressAsyncJob(AsyncJob *job, int wait) {
+   int worker, flag;
+   SEXP serialList, returnList;
+   SEXP serialResults, workerResultsList;
+
+   if (job->done) {
+      return(TRUE);
+   }
+
+   serialResults     = VECTOR_ELT(job->buffers, ASYNC_SERIAL_RESULTS);
+   workerResultsList = VECTOR_ELT(job->buffers, ASYNC_WORKER_RESULTS);
+
+   while(TRUE) {
+      if (wait) {
+         MPI_Waitany(job->nproc, job->recvRequests, &worker, 
+            MPI_STATUS_IGNORE);
+         flag = TRUE;
+      } else {
+         MPI_Testany(job->nproc, job->recvRequests, &worker, &flag,
+            MPI_STATUS_IGNORE);
+      }
+      if (!flag) {
+         return(FALSE);
+      }
+      if (worker == MPI_UNDEFINED) {
+         break;
+      }
+      if (job->states[worker] == ASYNC_WAIT_LENGTH) {
+         serialList = allocVector(RAWSXP, job->resultLengths[worker]);
+         SET_VECTOR_ELT(serialResults, worker, serialList);
+         irecvBytes(RAW(serialList), job->resultLengths[worker], worker,
+            job->tag + 1, job->comm, job->recvRequests + worker);
+         job->states[worker] = ASYNC_WAIT_DATA;
+      } else {
+         SET_VECTOR_ELT(workerResultsList, worker, 
+            unserializeRaw(VECTOR_ELT(serialResults, worker)));
+         SET_VECTOR_ELT(serialResults, worker, R_NilValue);
+         job->states[worker] = ASYNC_RECEIVED;
+      }
+   }
+
+   MPI_Wait(&job->commandRequest, MPI_STATUS_IGNORE);
+   MPI_Waitall(job->nproc, job->noticeRequests, MPI_STATUSES_IGNORE);
+   MPI_Waitall(ASYNC_HEADER_LENGTH * job->nproc, job->sendRequests,
+      MPI_STATUSES_IGNORE);
+
+   PROTECT(returnList = allocVector(VECSXP, job->length));
+   concatenateResults(workerResultsList, returnList);
+   SET_VECTOR_ELT(job->buffers, ASYNC_RETURN_LIST, returnList);
+   UNPROTECT(1);
+
+   finishAsyncJob(job);
+
+   return(TRUE);
+}
+
+/**
+   The handle of a job is no longer referenced.
+
+   A job in flight is freed when it completes.
+
+   @param[in] job          the job
+*/
+void releaseAsyncJob(AsyncJob *job) {
+   if (job->done) {
+      Free(job);
+   } else {
+      job->released = TRUE;
+   }
+}
+
+/**
+   Wait for every job in flight to complete.
+*/
+void drainAsyncJobs() {
+   while(asyncJobs != NULL) {
+      progressAsyncJob(asyncJobs, TRUE);
+   }
+}
+
+/**
+   Receive a job from the supervisor.
+
+   @param[out] header      the header of the job
+   @param[in]  comm        communicator of the group of the job
+   @return                 R list of the serialized function, remainder
+                           and arguments (not protected)
+*/
+SEXP workerReceiveAsyncJob(int64_t *header, MPI_Comm comm) {
+   int i;
+   SEXP payloads, serialized;
+
+   MPI_Recv(header, ASYNC_HEADER_LENGTH, MPI_INT64_T, 0, TAG_ASYNC_JOB, 
+      comm, MPI_STATUS_IGNORE);
+
+   PROTECT(payloads = allocVector(VECSXP, ASYNC_HEADER_LENGTH - 1));
+   for(i = 0; i < ASYNC_HEADER_LENGTH - 1; i++) {
+      serialized = allocVector(RAWSXP, header[i + 1]);
+      SET_VECTOR_ELT(payloads, i, serialized);
+      recvBytes(RAW(serialized), header[i + 1], 0, (int) header[0], comm);
+   }
+   UNPROTECT(1);
+
+   return(payloads);
+}
+
+/**
+   Start sending the results of a job without waiting for the supervisor.
+
+   The supervisor receives the results when it polls or waits on 
+   the job, so the sends are completed while the worker waits for
+   its next command.
+
+   @param[in] tag          the first tag of the job
+   @param[in] serialResults  R raw vector of serialized results
+   @param[in] comm         communicator of the group of the job
+*/
+void workerDeferResults(int tag, SEXP serialResults, MPI_Comm comm) {
+   int64_t length = XLENGTH(serialResults);
+   SEXP deferred;
+
+   if (numDeferred == deferredCapacity) {
+      deferredCapacity = 2 * deferredCapacity + 1;
+      deferredRequests = Realloc(deferredRequests, 2 * deferredCapacity,
+         MPI_Request);
+      deferredBuffers = Realloc(deferredBuffers, deferredCapacity, SEXP);
+   }
+
+   PROTECT(deferred = allocVector(VECSXP, 2));
+   SET_VECTOR_ELT(deferred, 0, allocVector(RAWSXP, sizeof(int64_t)));
+   memcpy(RAW(VECTOR_ELT(deferred, 0)), &length, sizeof(int64_t));
+   SET_VECTOR_ELT(deferred, 1, serialResults);
+   R_PreserveObject(deferred);
+   UNPROTECT(1);
+
+   MPI_Isend(RAW(VECTOR_ELT(deferred, 0)), 1, MPI_INT64_T, 0, tag, 
+      comm, deferredRequests + 2 * numDeferred);
+   isendBytes(RAW(serialResults), length, 0, tag + 1, comm,
+      deferredRequests + 2 * numDeferred + 1);
+
+   deferredBuffers[numDeferred] = deferred;
+   numDeferred++;
+}
+
+/**
+   Release the buffers of the deferred sends that have completed.
+*/
+static void releaseCompletedSends() {
+   int i, kept = 0;
+
+   for(i = 0; i < numDeferred; i++) {
+      if (deferredRequests[2 * i] == MPI_REQUEST_NULL &&
+         deferredRequests[2 * i + 1] == MPI_REQUEST_NULL) {
+         R_ReleaseObject(deferredBuffers[i]);
+      } else {
+         deferredRequests[2 * kept]     = deferredRequests[2 * i];
+         deferredRequests[2 * kept + 1] = deferredRequests[2 * i + 1];
+         deferredBuffers[kept] = deferredBuffers[i];
+         kept++;
+      }
+   }
+   numDeferred = kept;
+}
+
+/**
+   Wait for the next command or group job, completing deferred sends 
+   meanwhile.
+
+   @param[in,out] commandRequest   MPI request of the command broadcast
+   @param[in,out] groupRequest     MPI request of the next group job
+   @return                         TRUE if a group job has arrived,
+                                   FALSE if a command has arrived
+*/
+int waitForCommand(MPI_Request *commandRequest, MPI_Request *groupRequest) {
+   int index, count;
+   MPI_Request *requests;
+
+   do {
+      count = 2 + 2 * numDeferred;
+      requests = Calloc(count, MPI_Request);
+      requests[0] = *commandRequest;
+      requests[1] = *groupRequest;
+      memcpy(requests + 2, deferredRequests, 
+         2 * numDeferred * sizeof(MPI_Request));
+
+      MPI_Waitany(count, requests, &index, MPI_STATUS_IGNORE);
+
+      *commandRequest = requests[0];
+      *groupRequest   = requests[1];
+      memcpy(deferredRequests, requests + 2, 
+         2 * numDeferred * sizeof(MPI_Request));
+      Free(requests);
+
+      releaseCompletedSends();
+   } while(index > 1);
+
+   return(index == 1);
+}
+
+/**
+   Complete every deferred send before the worker terminates.
+*/
+void completeDeferredSends() {
+   MPI_Waitall(2 * numDeferred, deferredRequests, MPI_STATUSES_IGNORE);
+   releaseCompletedSends();
+
+   Free(deferredRequests);
+   Free(deferredBuffers);
+   deferredCapacity = 0;
+}
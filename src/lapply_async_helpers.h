@@ -0,0 +1,86 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef _lapply_async_helpers_h
+#define _lapply_async_helpers_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <stdint.h>
+
+// Number of tag pairs used by the jobs in flight at the same time.
+#define ASYNC_JOB_TAGS 16000
+
+// Number of 64-bit integers in the header announcing a job to a worker.
+#define ASYNC_HEADER_LENGTH 4
+
+// Elements of the R list holding the buffers of an asynchronous job.
+enum AsyncBuffer { ASYNC_FUN, ASYNC_REMAINDER, ASYNC_ARGS, 
+   ASYNC_WORKER_RESULTS, ASYNC_SERIAL_RESULTS, ASYNC_RETURN_LIST,
+   ASYNC_BUFFERS };
+
+// Progress of the results of one worker.
+enum AsyncState { ASYNC_WAIT_LENGTH, ASYNC_WAIT_DATA, ASYNC_RECEIVED };
+
+/*
+ * An lapply running on the workers while the supervisor continues.
+ * A job for every process is announced by the command broadcast, and
+ * a job for a group by sending the group to each of its workers on 
+ * TAG_GROUP_JOB, so that the other processes are not involved.
+ * Every worker is then sent a header { tag, function bytes, remainder 
+ * bytes, argument bytes } on TAG_ASYNC_JOB followed by the three 
+ * serialized objects on tag. The worker replies with the byte count 
+ * of its results on tag and the serialized results on tag + 1.
+ * All the messages use the communicator of the group of the job,
+ * readonly_asyncComm for every process, so that they never match 
+ * the messages of the synchronous commands. Ranks are group ranks.
+ */
+typedef struct AsyncJob {
+   int command;
+   int group;
+   int nproc;
+   int tag;
+   int length;
+   int done;
+   int released;
+   int64_t *headers;
+   int64_t *resultLengths;
+   int *states;
+   MPI_Comm comm;
+   MPI_Request commandRequest;
+   MPI_Request *noticeRequests;
+   MPI_Request *sendRequests;
+   MPI_Request *recvRequests;
+   SEXP buffers;
+   struct AsyncJob *next;
+} AsyncJob;
+
+AsyncJob *newAsyncJob(SEXP serializeFun, SEXP serializeArgs, 
+   SEXP serializeRemainder, int length, int group);
+void startAsyncJob(AsyncJob *job);
+void evaluateAsyncLocalWork(AsyncJob *job);
+int progressAsyncJob(AsyncJob *job, int wait);
+void releaseAsyncJob(AsyncJob *job);
+void drainAsyncJobs();
+
+SEXP workerReceiveAsyncJob(int64_t *header, MPI_Comm comm);
+void workerDeferResults(int tag, SEXP serialResults, MPI_Comm comm);
+int waitForCommand(MPI_Request *commandRequest, MPI_Request *groupRequest);
+void completeDeferredSends();
+
+#endif // _lapply_async_helpers_h
@@ -0,0 +1,152 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply_helpers.h"
+#include "lapply_workers_helpers.h"
+#include "lapply_dynamic_helpers.h"
+
+
+SEXP lapplyDynamicPiebaldMPI(SEXP serializeFun, SEXP serializeChunks, 
+      SEXP serializeRemainder, SEXP argLength, SEXP speculate) {
+
+   checkPiebaldInit();
+
+   int length = INTEGER(argLength)[0];
+   double timeout = REAL(speculate)[0];
+   int numChunks = LENGTH(serializeChunks);
+   SEXP chunkResultsList, returnList;
+   DynamicSchedule schedule;
+
+   PROTECT(chunkResultsList = allocVector(VECSXP, numChunks));
+   PROTECT(returnList = allocVector(VECSXP, length));
+
+   sendCommand(LAPPLY_DYNAMIC);
+
+   PROTECT(sendFunction(serializeFun));
+
+   PROTECT(sendRemainder(serializeRemainder));
+
+   initDynamicSchedule(&schedule, numChunks, timeout);
+
+   dispatchInitialChunks(&schedule, serializeChunks);
+
+   receiveChunkResults(&schedule, serializeChunks, chunkResultsList);
+
+   finishDynamicSchedule(&schedule, serializeChunks);
+
+   concatenateResults(chunkResultsList, returnList);
+
+   UNPROTECT(4);
+
+   return(returnList);
+}
+
+SEXP lapplyStreamPiebaldMPI(SEXP serializeFun, SEXP serializer, 
+      SEXP serializeRemainder, SEXP chunkBase, SEXP callback) {
+
+   checkPiebaldInit();
+
+   int numChunks = LENGTH(chunkBase);
+   DynamicSchedule schedule;
+   SEXP serializeChunks;
+
+   sendCommand(LAPPLY_DYNAMIC);
+
+   PROTECT(sendFunction(serializeFun));
+
+   PROTECT(sendRemainder(serializeRemainder));
+
+   PROTECT(serializeChunks = allocVector(VECSXP, numChunks));
+
+   initDynamicSchedule(&schedule, numChunks, 0);
+   schedule.callback   = callback;
+   schedule.serializer = serializer;
+   schedule.chunkBase  = INTEGER(chunkBase);
+
+   dispatchInitialChunks(&schedule, serializeChunks);
+
+   receiveChunkResults(&schedule, serializeChunks, R_NilValue);
+
+   finishDynamicSchedule(&schedule, serializeChunks);
+
+   UNPROTECT(3);
+
+   if (schedule.failed) {
+      error("The callback failed: %s", schedule.failure);
+   }
+
+   return(R_NilValue);
+}
+
+
+void lapplyDynamicWorkerPiebaldMPI() {
+   int64_t currentHeader[2], nextHeader[2];
+   SEXP theFunction, remainder, args, serialResult;
+   SEXP currentChunk, nextChunk;
+   MPI_Request request, headerRequest;
+   int arrived;
+   PROTECT_INDEX currentIndex, nextIndex;
+
+   theFunction = findFunction();
+
+   remainder = workerGetRemainder();
+
+   PROTECT_WITH_INDEX(currentChunk = workerReceiveChunk(currentHeader), 
+      &currentIndex);
+   PROTECT_WITH_INDEX(nextChunk = R_NilValue, &nextIndex);
+
+   while(currentChunk != R_NilValue) {
+      // A speculating supervisor holds back the next header until
+      // it has work to hand out, so never wait for it before computing.
+      workerPostChunkHeader(nextHeader, &headerRequest);
+      MPI_Test(&headerRequest, &arrived, MPI_STATUS_IGNORE);
+      if (arrived) {
+         REPROTECT(nextChunk = workerStartChunk(nextHeader, &request), 
+            nextIndex);
+      }
+
+      PROTECT(args = unserializeRaw(currentChunk));
+      PROTECT(serialResult = callLapply(args, theFunction, remainder));
+      serialResult = serializeObject(serialResult);
+      UNPROTECT(2);
+      PROTECT(serialResult);
+
+      workerSendChunkResult((int) currentHeader[0], serialResult);
+      UNPROTECT(1);
+
+      if (!arrived) {
+         MPI_Wait(&headerRequest, MPI_STATUS_IGNORE);
+         REPROTECT(nextChunk = workerStartChunk(nextHeader, &request), 
+            nextIndex);
+      }
+
+      MPI_Wait(&request, MPI_STATUS_IGNORE);
+      currentHeader[0] = nextHeader[0];
+      currentHeader[1] = nextHeader[1];
+      REPROTECT(currentChunk = nextChunk, currentIndex);
+   }
+
+   UNPROTECT(4);
+}
@@ -0,0 +1,573 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <string.h>
+#include <math.h>
+#include <time.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply_helpers.h"
+#include "lapply_dynamic_helpers.h"
+#include "bigcount.h"
+
+// A speculative schedule whose late copies are still running.
+static DynamicSchedule staleSchedule;
+static SEXP staleChunks = NULL;
+
+/**
+   Allocate the bookkeeping for a dynamic schedule.
+
+   Each chunk needs one header and two send requests, and each
+   worker needs one terminating header and one send request.
+   A speculative schedule may send every chunk a second time.
+
+   @param[out] schedule     the schedule to initialize
+   @param[in]  numChunks    number of chunks in the work queue
+   @param[in]  timeout      seconds before a running chunk is sent to 
+                            an idle worker, or zero to never speculate
+*/
+void initDynamicSchedule(DynamicSchedule *schedule, int numChunks, 
+   double timeout) {
+
+   int i, maxSends = numChunks + readonly_nproc;
+
+   if (timeout > 0) {
+      maxSends += numChunks;
+   }
+
+   schedule->numChunks     = numChunks;
+   schedule->nextChunk     = 0;
+   schedule->numSends      = 0;
+   schedule->numRequests   = 0;
+   schedule->completed     = 0;
+   schedule->timeout       = timeout;
+   schedule->callback      = R_NilValue;
+   schedule->serializer    = R_NilValue;
+   schedule->chunkBase     = NULL;
+   schedule->failed        = FALSE;
+   schedule->failure[0]    = '\0';
+   schedule->headers       = Calloc(2 * maxSends, int64_t);
+   schedule->terminated    = Calloc(readonly_nproc, int);
+   schedule->outstanding   = Calloc(readonly_nproc, int);
+   schedule->copies        = Calloc(numChunks, int);
+   schedule->done          = Calloc(numChunks, int);
+   schedule->queues        = Calloc(readonly_nproc * DYNAMIC_PREFETCH_DEPTH,
+                                    int);
+   schedule->dataRequests  = Calloc(numChunks, int);
+   schedule->startTimes    = Calloc(numChunks, double);
+   schedule->requests      = Calloc(2 * maxSends, MPI_Request);
+
+   for(i = 0; i < numChunks; i++) {
+      schedule->startTimes[i] = -1;
+   }
+}
+
+/**
+   Wait for all outstanding sends and release the bookkeeping.
+
+   @param[in] schedule     the schedule to release
+*/
+void freeDynamicSchedule(DynamicSchedule *schedule) {
+   MPI_Waitall(schedule->numRequests, schedule->requests, 
+      MPI_STATUSES_IGNORE);
+   Free(schedule->headers);
+   Free(schedule->terminated);
+   Free(schedule->outstanding);
+   Free(schedule->copies);
+   Free(schedule->done);
+   Free(schedule->queues);
+   Free(schedule->dataRequests);
+   Free(schedule->startTimes);
+   Free(schedule->requests);
+}
+
+/**
+   Terminate the workers and release the schedule.
+
+   Workers that are still running a losing copy of a speculated chunk
+   are not waited for. Their schedule is kept, together with the
+   serialized chunks, until drainDynamicSchedule() discards their results.
+
+   @param[in] schedule          the dynamic schedule
+   @param[in] serializeChunks   R list of raw vectors with serialized input
+*/
+void finishDynamicSchedule(DynamicSchedule *schedule, SEXP serializeChunks) {
+   int worker, running = FALSE;
+
+   for(worker = 1; worker < readonly_nproc; worker++) {
+      dispatchNextChunk(schedule, worker, serializeChunks);
+      running |= schedule->outstanding[worker] > 0;
+   }
+
+   if (!running) {
+      freeDynamicSchedule(schedule);
+      return;
+   }
+
+   staleSchedule = *schedule;
+   staleChunks = serializeChunks;
+   R_PreserveObject(staleChunks);
+}
+
+/**
+   Discard the late copies of a previous speculative schedule.
+
+   The supervisor must call this before it sends the workers anything
+   else, as the workers send the late results with blocking sends.
+*/
+void drainDynamicSchedule() {
+   int worker;
+   int64_t header[2];
+   SEXP serialResult;
+
+   if (staleChunks == NULL) {
+      return;
+   }
+
+   for(worker = 1; worker < readonly_nproc; worker++) {
+      while(staleSchedule.outstanding[worker] > 0) {
+         MPI_Recv(header, 2, MPI_INT64_T, worker, TAG_CHUNK_RESULT_HEADER, 
+            MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+         PROTECT(serialResult = allocVector(RAWSXP, header[1]));
+         recvBytes(RAW(serialResult), header[1], worker, 
+            TAG_CHUNK_RESULT_DATA, MPI_COMM_WORLD);
+         UNPROTECT(1);
+         staleSchedule.outstanding[worker]--;
+      }
+   }
+
+   freeDynamicSchedule(&staleSchedule);
+   R_ReleaseObject(staleChunks);
+   staleChunks = NULL;
+}
+
+/**
+   Sleep for a short while.
+
+   @param[in] seconds      length of the pause
+*/
+static void pauseSeconds(double seconds) {
+   struct timespec pause;
+
+   pause.tv_sec  = (time_t) seconds;
+   pause.tv_nsec = (long) ((seconds - pause.tv_sec) * 1e9);
+   nanosleep(&pause, NULL);
+}
+
+/**
+   Note the time a chunk starts running, unless a copy already has.
+
+   @param[in,out] schedule     the dynamic schedule
+   @param[in]     index        index of the chunk in the work queue
+*/
+static void startChunk(DynamicSchedule *schedule, int index) {
+   if (schedule->startTimes[index] < 0) {
+      schedule->startTimes[index] = MPI_Wtime();
+   }
+}
+
+/**
+   Remove the chunk that a worker has finished from its queue.
+
+   The next chunk in the queue of the worker starts running.
+
+   @param[in,out] schedule     the dynamic schedule
+   @param[in]     worker       rank of the worker process
+*/
+static void finishQueuedChunk(DynamicSchedule *schedule, int worker) {
+   int i;
+   int *queue = schedule->queues + worker * DYNAMIC_PREFETCH_DEPTH;
+
+   schedule->outstanding[worker]--;
+   for(i = 0; i < schedule->outstanding[worker]; i++) {
+      queue[i] = queue[i + 1];
+   }
+   if (schedule->outstanding[worker] > 0) {
+      startChunk(schedule, queue[0]);
+   }
+}
+
+/**
+   Serialize a chunk of the work queue with the serializer of the schedule.
+
+   @param[in]     schedule          the dynamic schedule
+   @param[in]     index             index of the chunk in the work queue
+   @param[in,out] serializeChunks   R list of raw vectors with serialized input
+   @return                          R raw vector storing the serialized chunk
+*/
+static SEXP serializeChunk(DynamicSchedule *schedule, int index, 
+   SEXP serializeChunks) {
+
+   SEXP serializerCall, chunk;
+
+   PROTECT(serializerCall = lang2(schedule->serializer, 
+      ScalarInteger(index + 1)));
+   chunk = eval(serializerCall, R_GlobalEnv);
+   SET_VECTOR_ELT(serializeChunks, index, chunk);
+   UNPROTECT(1);
+
+   return(chunk);
+}
+
+/**
+   Release a chunk of a schedule with a serializer once it is done.
+
+   The worker has received the chunk, so its send completes at once.
+
+   @param[in,out] schedule          the dynamic schedule
+   @param[in]     index             index of the chunk in the work queue
+   @param[in,out] serializeChunks   R list of raw vectors with serialized input
+*/
+static void releaseChunk(DynamicSchedule *schedule, int index, 
+   SEXP serializeChunks) {
+
+   if (schedule->serializer == R_NilValue) {
+      return;
+   }
+   MPI_Wait(schedule->requests + schedule->dataRequests[index], 
+      MPI_STATUS_IGNORE);
+   SET_VECTOR_ELT(serializeChunks, index, R_NilValue);
+}
+
+/**
+   Send one chunk of the work queue to a worker.
+
+   @param[in,out] schedule          the dynamic schedule
+   @param[in]     worker            rank of the worker process
+   @param[in]     index             index of the chunk in the work queue
+   @param[in]     serializeChunks   R list of raw vectors with serialized input
+*/
+static void dispatchChunk(DynamicSchedule *schedule, int worker, int index,
+   SEXP serializeChunks) {
+
+   int64_t *header = schedule->headers + 2 * schedule->numSends;
+   SEXP chunk = VECTOR_ELT(serializeChunks, index);
+
+   if (chunk == R_NilValue) {
+      chunk = serializeChunk(schedule, index, serializeChunks);
+   }
+
+   schedule->numSends++;
+   header[0] = index;
+   header[1] = XLENGTH(chunk);
+
+   if (schedule->outstanding[worker] == 0) {
+      startChunk(schedule, index);
+   }
+   schedule->queues[worker * DYNAMIC_PREFETCH_DEPTH + 
+      schedule->outstanding[worker]++] = index;
+   schedule->copies[index]++;
+
+   MPI_Isend(header, 2, MPI_INT64_T, worker, TAG_CHUNK_HEADER, 
+      MPI_COMM_WORLD, schedule->requests + schedule->numRequests++);
+   schedule->dataRequests[index] = schedule->numRequests;
+   isendBytes(RAW(chunk), header[1], worker, TAG_CHUNK_DATA,
+      MPI_COMM_WORLD, schedule->requests + schedule->numRequests++);
+}
+
+/**
+   Send the next chunk in the work queue to a worker.
+
+   If the work queue is empty, then the worker is sent a terminating
+   header instead (at most once per worker). All sends are nonblocking,
+   as the worker may be busy computing its previous chunk. The serialized
+   chunks are owned by the caller and must remain protected until
+   freeDynamicSchedule() has been called.
+
+   @param[in,out] schedule          the dynamic schedule
+   @param[in]     worker            rank of the worker process
+   @param[in]     serializeChunks   R list of raw vectors with serialized input
+*/
+void dispatchNextChunk(DynamicSchedule *schedule, int worker, 
+   SEXP serializeChunks) {
+
+   int64_t *header;
+
+   if (schedule->nextChunk < schedule->numChunks) {
+      dispatchChunk(schedule, worker, schedule->nextChunk++, 
+         serializeChunks);
+      return;
+   }
+
+   if (schedule->terminated[worker]) {
+      return;
+   }
+
+   header = schedule->headers + 2 * schedule->numSends;
+   schedule->numSends++;
+   header[0] = -1;
+   header[1] = 0;
+   schedule->terminated[worker] = TRUE;
+   MPI_Isend(header, 2, MPI_INT64_T, worker, TAG_CHUNK_HEADER, 
+      MPI_COMM_WORLD, schedule->requests + schedule->numRequests++);
+}
+
+/**
+   Fill the queue of every worker up to the prefetch depth.
+
+   Each worker is given DYNAMIC_PREFETCH_DEPTH chunks, so that the
+   next chunk is in transit while the current chunk is evaluated.
+   The first chunks are dealt out round-robin, which hands the 
+   largest chunks of the guided schedule out first.
+
+   @param[in,out] schedule          the dynamic schedule
+   @param[in]     serializeChunks   R list of raw vectors with serialized input
+*/
+void dispatchInitialChunks(DynamicSchedule *schedule, SEXP serializeChunks) {
+   int i, worker;
+
+   for(i = 0; i < DYNAMIC_PREFETCH_DEPTH; i++) {
+      for(worker = 1; worker < readonly_nproc; worker++) {
+         if (schedule->nextChunk < schedule->numChunks || 
+               schedule->timeout <= 0) {
+            dispatchNextChunk(schedule, worker, serializeChunks);
+         }
+      }
+   }
+}
+
+/**
+   Send a second copy of overdue chunks to the idle workers.
+
+   A chunk is overdue when it has a single copy running for longer 
+   than the timeout. The chunk that started first is sent first.
+
+   @param[in,out] schedule          the dynamic schedule
+   @param[in]     serializeChunks   R list of raw vectors with serialized input
+*/
+static void speculateChunks(DynamicSchedule *schedule, SEXP serializeChunks) {
+   int i, worker, oldest;
+   double now = MPI_Wtime();
+
+   for(worker = 1; worker < readonly_nproc; worker++) {
+      if (schedule->terminated[worker] || schedule->outstanding[worker] > 0) {
+         continue;
+      }
+      oldest = -1;
+      for(i = 0; i < schedule->nextChunk; i++) {
+         if (!schedule->done[i] && schedule->copies[i] == 1 &&
+               schedule->startTimes[i] >= 0 &&
+               now - schedule->startTimes[i] > schedule->timeout &&
+               (oldest < 0 || schedule->startTimes[i] < 
+                  schedule->startTimes[oldest])) {
+            oldest = i;
+         }
+      }
+      if (oldest < 0) {
+         return;
+      }
+      dispatchChunk(schedule, worker, oldest, serializeChunks);
+   }
+}
+
+/**
+   Pass the results of a chunk to the callback of a streaming schedule.
+
+   The callback is evaluated under R_tryEvalSilent(), as an error must
+   not leave the chunk protocol half finished. On the first error the
+   work queue is cut short at the chunks already handed out, and the
+   results of those chunks are discarded.
+
+   @param[in,out] schedule     the dynamic schedule
+   @param[in]     index        index of the chunk in the work queue
+   @param[in]     results      R list of the results of the chunk 
+                               (not protected)
+*/
+static void streamChunkResults(DynamicSchedule *schedule, int index, 
+   SEXP results) {
+
+   int i;
+   size_t length;
+   SEXP callbackCall;
+
+   PROTECT(results);
+   for(i = 0; i < LENGTH(results) && !schedule->failed; i++) {
+      PROTECT(callbackCall = lang3(schedule->callback, 
+         ScalarInteger(schedule->chunkBase[index] + i), 
+         VECTOR_ELT(results, i)));
+      R_tryEvalSilent(callbackCall, R_GlobalEnv, &schedule->failed);
+      UNPROTECT(1);
+   }
+   UNPROTECT(1);
+
+   if (schedule->failed) {
+      strncpy(schedule->failure, R_curErrorBuf(), 
+         CALLBACK_ERROR_LENGTH - 1);
+      schedule->failure[CALLBACK_ERROR_LENGTH - 1] = '\0';
+      length = strlen(schedule->failure);
+      while(length > 0 && schedule->failure[length - 1] == '\n') {
+         schedule->failure[--length] = '\0';
+      }
+      schedule->numChunks = schedule->nextChunk;
+   }
+}
+
+/**
+   Receive the results of every chunk, refilling workers as they finish.
+
+   Results arrive in completion order. Each result is stored at the
+   index of its chunk, so that the caller can restore the original order,
+   or streamed to the callback of the schedule and released.
+   When the schedule speculates, the supervisor polls for results so 
+   that it can hand overdue chunks to idle workers, and the results of
+   the second copy of a chunk to finish are discarded. It pauses 
+   between polls, for longer while no result arrives, so that it does
+   not keep a core busy.
+
+   @param[in,out] schedule          the dynamic schedule
+   @param[in]     serializeChunks   R list of raw vectors with serialized input
+   @param[out]    chunkResultsList  R list storing the results of each chunk
+                                    (unused by a streaming schedule)
+*/
+void receiveChunkResults(DynamicSchedule *schedule, SEXP serializeChunks, 
+   SEXP chunkResultsList) {
+
+   int worker, index, arrived;
+   int64_t header[2];
+   double pause = SPECULATE_POLL_MIN;
+   double maxPause = fmin(SPECULATE_POLL_MAX, schedule->timeout / 10);
+   MPI_Status status;
+   SEXP serialResult;
+
+   while(schedule->completed < schedule->numChunks) {
+      if (schedule->timeout > 0) {
+         MPI_Iprobe(MPI_ANY_SOURCE, TAG_CHUNK_RESULT_HEADER, 
+            MPI_COMM_WORLD, &arrived, MPI_STATUS_IGNORE);
+         if (!arrived) {
+            speculateChunks(schedule, serializeChunks);
+            pauseSeconds(pause);
+            pause = fmin(2 * pause, maxPause);
+            continue;
+         }
+         pause = SPECULATE_POLL_MIN;
+      }
+
+      MPI_Recv(header, 2, MPI_INT64_T, MPI_ANY_SOURCE, 
+         TAG_CHUNK_RESULT_HEADER, MPI_COMM_WORLD, &status);
+      worker = status.MPI_SOURCE;
+      index = (int) header[0];
+      finishQueuedChunk(schedule, worker);
+      releaseChunk(schedule, index, serializeChunks);
+
+      PROTECT(serialResult = allocVector(RAWSXP, header[1]));
+      recvBytes(RAW(serialResult), header[1], worker, 
+         TAG_CHUNK_RESULT_DATA, MPI_COMM_WORLD);
+
+      if (schedule->nextChunk < schedule->numChunks || 
+            schedule->timeout <= 0) {
+         dispatchNextChunk(schedule, worker, serializeChunks);
+      }
+
+      if (!schedule->done[index]) {
+         schedule->done[index] = TRUE;
+         schedule->completed++;
+         if (schedule->callback == R_NilValue) {
+            SET_VECTOR_ELT(chunkResultsList, index, 
+               unserializeRaw(serialResult));
+         } else if (!schedule->failed) {
+            streamChunkResults(schedule, index, 
+               unserializeRaw(serialResult));
+         }
+      }
+      UNPROTECT(1);
+   }
+}
+
+/**
+   Receive a chunk header and its chunk from the supervisor.
+
+   @param[out] header      two integer chunk header { index, length }
+   @return                 R raw vector storing the serialized chunk, 
+                           or R_NilValue if no more chunks will follow.
+*/
+SEXP workerReceiveChunk(int64_t *header) {
+   SEXP chunk;
+
+   MPI_Recv(header, 2, MPI_INT64_T, 0, TAG_CHUNK_HEADER, 
+      MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+
+   if (header[0] < 0) {
+      return(R_NilValue);
+   }
+
+   chunk = allocVector(RAWSXP, header[1]);
+   recvBytes(RAW(chunk), header[1], 0, TAG_CHUNK_DATA, MPI_COMM_WORLD);
+
+   return(chunk);
+}
+
+/**
+   Start receiving the next chunk header.
+
+   @param[out] header         two integer chunk header { index, length }
+   @param[out] headerRequest  MPI request for the header receive
+*/
+void workerPostChunkHeader(int64_t *header, MPI_Request *headerRequest) {
+   MPI_Irecv(header, 2, MPI_INT64_T, 0, TAG_CHUNK_HEADER, 
+      MPI_COMM_WORLD, headerRequest);
+}
+
+/**
+   Start receiving the chunk announced by a header.
+
+   The chunk is received in the background while the current chunk 
+   is evaluated. The caller must protect the chunk and wait on the
+   request before reading it.
+
+   @param[in]  header      two integer chunk header { index, length }
+   @param[out] request     MPI request for the chunk receive
+   @return                 R raw vector that will store the serialized chunk,
+                           or R_NilValue if no more chunks will follow.
+*/
+SEXP workerStartChunk(int64_t *header, MPI_Request *request) {
+   SEXP chunk;
+
+   if (header[0] < 0) {
+      *request = MPI_REQUEST_NULL;
+      return(R_NilValue);
+   }
+
+   chunk = allocVector(RAWSXP, header[1]);
+   irecvBytes(RAW(chunk), header[1], 0, TAG_CHUNK_DATA, MPI_COMM_WORLD,
+      request);
+
+   return(chunk);
+}
+
+/**
+   Send the serialized results of a chunk to the supervisor.
+
+   @param[in] index          index of the chunk in the work queue
+   @param[in] serialResult   R raw vector storing the serialized results
+*/
+void workerSendChunkResult(int index, SEXP serialResult) {
+   int64_t header[2];
+
+   header[0] = index;
+   header[1] = XLENGTH(serialResult);
+
+   MPI_Send(header, 2, MPI_INT64_T, 0, TAG_CHUNK_RESULT_HEADER, 
+      MPI_COMM_WORLD);
+   sendBytes(RAW(serialResult), header[1], 0, TAG_CHUNK_RESULT_DATA, 
+      MPI_COMM_WORLD);
+}
@@ -0,0 +1,104 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _lapply_dynamic_helpers_h
+#define _lapply_dynamic_helpers_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <stdint.h>
+
+// Number of chunks each worker holds at once: one running, one in transit.
+#define DYNAMIC_PREFETCH_DEPTH 2
+
+// Shortest and longest pause between polls of a speculative schedule,
+// in seconds. The pause doubles while no result arrives.
+#define SPECULATE_POLL_MIN 50e-6
+#define SPECULATE_POLL_MAX 10e-3
+
+// Longest error message of a streaming callback that is kept.
+#define CALLBACK_ERROR_LENGTH 1024
+
+/*
+ * Bookkeeping for the chunks handed out by the supervisor.
+ * Every chunk is announced by a two integer header { index, length }
+ * followed by the serialized chunk. A header with a negative index
+ * tells the worker that no more chunks will follow.
+ *
+ * With a positive timeout the schedule speculates: once the work queue
+ * is empty, a chunk that has been running longer than the timeout is
+ * sent again to an idle worker, and the first copy to finish is kept.
+ * Workers run their chunks in the order they were sent, so a chunk is
+ * running from the time it is sent to an idle worker, or else from
+ * the time its worker returns the result of the chunk ahead of it.
+ * Chunks waiting in a worker's queue are never speculated on.
+ *
+ * A streaming schedule passes every result to an R callback instead
+ * of keeping it. The callback is called with the index of the task in
+ * the input and its result, as soon as the chunk of the task arrives.
+ * If the callback fails, no further chunks are handed out, the chunks
+ * already sent are received and discarded, and the error is kept in
+ * failure so that it can be raised once the workers are stopped.
+ *
+ * A schedule with a serializer serializes each chunk only when it is
+ * first dispatched, and releases it once its result has arrived, so
+ * only the chunks in flight are held. The serializer is an R function
+ * of the 1-based index of a chunk that returns its serialized raw
+ * vector. Such a schedule must not speculate.
+ */
+typedef struct {
+   int numChunks;
+   int nextChunk;
+   int numSends;
+   int numRequests;
+   int completed;
+   double timeout;
+   SEXP callback;
+   SEXP serializer;
+   int *chunkBase;
+   int failed;
+   char failure[CALLBACK_ERROR_LENGTH];
+   int64_t *headers;
+   int *terminated;
+   int *outstanding;
+   int *copies;
+   int *done;
+   int *queues;
+   int *dataRequests;
+   double *startTimes;
+   MPI_Request *requests;
+} DynamicSchedule;
+
+void initDynamicSchedule(DynamicSchedule *schedule, int numChunks, 
+   double timeout);
+void freeDynamicSchedule(DynamicSchedule *schedule);
+void finishDynamicSchedule(DynamicSchedule *schedule, SEXP serializeChunks);
+void drainDynamicSchedule();
+void dispatchNextChunk(DynamicSchedule *schedule, int worker, 
+   SEXP serializeChunks);
+void dispatchInitialChunks(DynamicSchedule *schedule, SEXP serializeChunks);
+void receiveChunkResults(DynamicSchedule *schedule, SEXP serializeChunks, 
+   SEXP chunkResultsList);
+
+SEXP workerReceiveChunk(int64_t *header);
+void workerPostChunkHeader(int64_t *header, MPI_Request *headerRequest);
+SEXP workerStartChunk(int64_t *header, MPI_Request *request);
+void workerSendChunkResult(int index, SEXP serialResult);
+
+#endif // _lapply_dynamic_helpers_h
@@ -24,17 +24,27 @@
 #include "commands.h"
 #include "state.h"
 #include "lapply_helpers.h"
+#include "cache.h"
+#include "export.h"
+#include "typed.h"
+#include "compress.h"
+#include "bigcount.h"
+#include "profile.h"
+#include "serialize.h"
+#include "shared.h"
+#include "pool.h"
 
 /**
-   Broadcast the name of a function from the supervisor to the worker processes.
+   Broadcast the function from the supervisor to the worker processes.
+
+   The function is only broadcast if it is not already cached,
+   and it is bound to the exports before it is returned.
 
    @param[in] serializeFun R raw vector storing serialized function
+   @return                 R function (not protected)
 */
-void sendFunction(SEXP serializeFun) {
-   int length = LENGTH(serializeFun);
-   MPI_Bcast(&length, 1, MPI_INT, 0, MPI_COMM_WORLD);
-   MPI_Bcast((void*) RAW(serializeFun), length, 
-      MPI_BYTE, 0, MPI_COMM_WORLD);
+SEXP sendFunction(SEXP serializeFun) {
+   return(bindExports(sendCachedObject(serializeFun)));
 }
 
 
@@ -42,13 +52,13 @@ void sendFunction(SEXP serializeFun) {
 /**
    Broadcast the "..." arguments from the supervisor to the worker processes.
 
+   The arguments are only broadcast if they are not already cached.
+
    @param[in] serializeRemainder R raw vector storing serialized "..." args
+   @return                       R list of "..." args (not protected)
 */
-void sendRemainder(SEXP serializeRemainder) {
-   int remainderLength = LENGTH(serializeRemainder);
-   MPI_Bcast(&remainderLength, 1, MPI_INT, 0, MPI_COMM_WORLD);
-   MPI_Bcast((void*) RAW(serializeRemainder), remainderLength, 
-      MPI_BYTE, 0, MPI_COMM_WORLD);
+SEXP sendRemainder(SEXP serializeRemainder) {
+   return(sendCachedObject(serializeRemainder));
 }
 
 
@@ -61,118 +71,144 @@ void sendRemainder(SEXP serializeRemainder) {
 
    @param[out] lengths          array of byte counts
    @param[in]  serializeArgs    R list of raw vectors with serialized input
-   @param[out] totalLength      sum of rawByteCounts
 */
-void sendRawByteCounts(int *lengths, SEXP serializeArgs, 
-                       int *totalLength) {
-   int length = 0;
-   int i, supervisorByteCount;
-   SEXP arg;
+void sendRawByteCounts(int64_t *lengths, SEXP serializeArgs) {
+   int i;
+   int64_t supervisorByteCount;
 
-   *totalLength = 0;
    for(i = 0; i < readonly_nproc; i++) {
-      PROTECT(arg = VECTOR_ELT(serializeArgs, i));
-      length = LENGTH(arg);
-      *totalLength += length;
-      lengths[i] = length;
-      UNPROTECT(1);
+      lengths[i] = XLENGTH(VECTOR_ELT(serializeArgs, i));
    }
 
-   MPI_Scatter(lengths, 1, MPI_INT, &supervisorByteCount, 
-      1, MPI_INT, 0, MPI_COMM_WORLD);
+   MPI_Scatter(lengths, 1, MPI_INT64_T, &supervisorByteCount, 
+      1, MPI_INT64_T, 0, MPI_COMM_WORLD);
 }
 
 /**
-   Use the raw byte counts to generate raw byte displacements.
+   Send the tasks to the worker processes.
 
-   Given the array of raw byte counts, generate the array of raw
-   byte displacements. MPI variable length broadcasts require an array
-   of counts and an array of displacements. Since we have zero bytes
-   padded in between elements of the output buffer, it is trivial
-   to determine the diplacement array given the byte count array.
+   Each serialized list of tasks is sent directly from the memory
+   of its R raw vector, so no staging buffer is needed. The
+   supervisor's own tasks are not sent.
 
-   @param[out]  displacements     array of byte displacements
-   @param[in]   lengths           array of byte counts
+   @param[in]  lengths           array of byte counts
+   @param[in]  serializeArgs     R list of raw vectors with serialized input
 */
-void generateRawByteDisplacements(int *displacements, int *lengths) {
+void sendArgRawBytes(int64_t *lengths, SEXP serializeArgs) {
    int i;
+   MPI_Request *requests = poolRequests();
+
+   requests[0] = MPI_REQUEST_NULL;
    for(i = 1; i < readonly_nproc; i++) {
-      displacements[i] = lengths[i - 1] + displacements[i - 1];
+      isendBytes(RAW(VECTOR_ELT(serializeArgs, i)), lengths[i], i, 
+         TAG_ARGS, MPI_COMM_WORLD, requests + i);
+      profileBytes(PROFILE_SCATTER, lengths[i]);
    }
+
+   MPI_Waitall(readonly_nproc, requests, MPI_STATUSES_IGNORE);
 }
 
 /**
-   Broadcast the tasks to the worker processes.
+   Send the tasks to the worker processes as native typed buffers.
 
-   @param[in]  displacements     array of byte displacements
-   @param[in]  lengths           array of byte counts
-   @param[in]  totalLength       sum of lengths
-   @param[in]  serializeArgs     R list of raw vectors with serialized input
+   The input is an atomic vector without attributes. The element 
+   counts are scattered, and then each worker's segment is sent 
+   directly from the memory of the input vector, without serialization.
+
+   @param[in]  input        R logical, integer, double or complex vector
+   @param[in]  argBase      R integer vector of 1-based segment offsets
+   @param[in]  argCount     R integer vector of segment lengths
 */
-void sendArgRawBytes(int *displacements, int *lengths, int totalLength, 
-   SEXP serializeArgs) {
-
-   int i, numArgs = LENGTH(serializeArgs);
-   int offset, currentLength = 0;
-   SEXP arg;
-  
-   unsigned char *sendBuffer = NULL, *receiveBuffer = NULL;
-
-   sendBuffer = Calloc(totalLength, unsigned char);
-   receiveBuffer = Calloc(lengths[0], unsigned char);
-
-   for(i = 0; i < numArgs; i++) {
-      PROTECT(arg = VECTOR_ELT(serializeArgs, i));
-      offset = LENGTH(arg);
-      memcpy(sendBuffer + currentLength, RAW(arg), offset);
-      currentLength += offset;
-      UNPROTECT(1);
-   }
+void sendTypedArgs(SEXP input, SEXP argBase, SEXP argCount) {
+   int i, supervisorCount;
+   size_t size = typedElementSize(TYPEOF(input));
+   MPI_Datatype datatype = typedDatatype(TYPEOF(input));
+   MPI_Request *requests = poolRequests();
 
-   MPI_Scatterv(sendBuffer, lengths, displacements, MPI_BYTE,
-      receiveBuffer, lengths[0], MPI_BYTE, 0, MPI_COMM_WORLD);
+   MPI_Scatter(INTEGER(argCount), 1, MPI_INT, &supervisorCount, 
+      1, MPI_INT, 0, MPI_COMM_WORLD);
+
+   requests[0] = MPI_REQUEST_NULL;
+   for(i = 1; i < readonly_nproc; i++) {
+      MPI_Isend(typedDataPointer(input) + 
+            (size_t) (INTEGER(argBase)[i] - 1) * size, 
+         INTEGER(argCount)[i], datatype, i, TAG_ARGS, MPI_COMM_WORLD, 
+         requests + i);
+      profileBytes(PROFILE_SCATTER, (double) INTEGER(argCount)[i] * size);
+   }
 
-   Free(sendBuffer);
-   Free(receiveBuffer);
+   MPI_Waitall(readonly_nproc, requests, MPI_STATUSES_IGNORE);
 }
 
 /**
-   The supervisor task processes its share of the work.
+   Determine how the tasks are encoded for transmission.
 
-   After broadcasting the data for each task to the workers,
-   the supervisor task now processes its share of the work.
+   @param[in]  args         R list of raw vectors with serialized input,
+                            or an R atomic vector sent as a typed buffer
+   @return                  RAWSXP for serialized input, otherwise
+                            the type of the atomic vector
+*/
+int argumentEncoding(SEXP args) {
+   if (isTypedVector(args)) {
+      return(TYPEOF(args));
+   }
+   return(RAWSXP);
+}
 
-   @param[in]  function            R raw vector storing serialized function.
-   @param[in]  serializeArgs       R list of raw vectors with serialized input
-   @param[in]  serializeRemainder  R raw vector storing serialized "..." args
-   @param[out] returnList          R list storing results of evaluation
+/**
+   The supervisor's own share of the tasks.
+
+   @param[in]  args         R list of raw vectors with serialized input,
+                            or an R atomic vector sent as a typed buffer
+   @param[in]  argBase      R integer vector of 1-based segment offsets
+   @param[in]  argCount     R integer vector of segment lengths
+   @return                  R list or vector of arguments (not protected)
 */
-void evaluateLocalWork(SEXP serializedFunction, SEXP serializeArgs, 
-   SEXP serializeRemainder, SEXP returnList) {
+SEXP localArgs(SEXP args, SEXP argBase, SEXP argCount) {
+   if (argumentEncoding(args) != RAWSXP) {
+      return(typedSegment(args, INTEGER(argBase)[0], INTEGER(argCount)[0]));
+   }
+   return(unserializeRaw(VECTOR_ELT(args, 0)));
+}
 
-   SEXP unserializeCall, functionCall;
-   SEXP theFunction;
-   SEXP args, remainder;
+/**
+   The total number of tasks.
 
-   PROTECT(unserializeCall = lang2(readonly_unserialize, R_NilValue));
+   @param[in]  argCount     R integer vector of segment lengths
+   @return                  sum of the segment lengths
+*/
+int sumCounts(SEXP argCount) {
+   int i, total = 0;
 
-   SETCADR(unserializeCall, serializeRemainder);
-   PROTECT(remainder = eval(unserializeCall, R_GlobalEnv));
+   for(i = 0; i < LENGTH(argCount); i++) {
+      total += INTEGER(argCount)[i];
+   }
 
-   SETCADR(unserializeCall, serializedFunction);
-   PROTECT(theFunction = eval(unserializeCall, R_GlobalEnv));
+   return(total);
+}
 
-   SETCADR(unserializeCall, VECTOR_ELT(serializeArgs, 0));
-   PROTECT(args = eval(unserializeCall, R_GlobalEnv));
+/**
+   The supervisor task processes its share of the work.
 
-   functionCall = Rf_VectorToPairList(remainder);
+   After broadcasting the data for each task to the workers,
+   the supervisor task now processes its share of the work.
 
-   PROTECT(functionCall = LCONS(readonly_lapply, 
-             LCONS(args, LCONS(theFunction, functionCall))));
+   @param[in]  theFunction         R function
+   @param[in]  args                R list of raw vectors with serialized 
+                                   input, or R atomic vector
+   @param[in]  argBase             R integer vector of 1-based offsets
+   @param[in]  argCount            R integer vector of segment lengths
+   @param[in]  remainder           R list of "..." args
+   @param[out] returnList          R list storing results of evaluation
+*/
+void evaluateLocalWork(SEXP theFunction, SEXP args, SEXP argBase,
+   SEXP argCount, SEXP remainder, SEXP returnList) {
 
-   SET_VECTOR_ELT(returnList, 0, eval(functionCall, R_GlobalEnv));
+   PROTECT(args = localArgs(args, argBase, argCount));
 
-   UNPROTECT(5);
+   SET_VECTOR_ELT(returnList, 0, callLapply(args, theFunction, remainder));
+
+   UNPROTECT(1);
 }
 
 
@@ -182,91 +218,202 @@ void evaluateLocalWork(SEXP serializedFunction, SEXP serializeArgs,
 
    After processing its local tasks, each worker informs the supervisor
    of the total number of bytes the worker has generated, so that the 
-   supervisor can allocate enough memory in the receive buffer.
-
-   @param[in]   lengths         total byte count per worker
-   @param[out]  displacements   displacement buffer per worker
-   @param[out]  total           total number of bytes to receive
+   supervisor can lay the results out in one receive buffer.
 
+   @param[out]  lengths         total byte count per worker, followed
+                                by the offset of each worker in the buffer
+   @return                      total byte count of all workers
 */
-void receiveIncomingLengths(int *lengths, int *displacements, int *total) {
-   int i, empty = 0;
+R_xlen_t receiveIncomingLengths(int64_t *lengths) {
+   int i;
+   int64_t empty = 0;
+   R_xlen_t total = 0;
 
-   MPI_Gather(&empty, 1, MPI_INT, lengths, 
-      1, MPI_INT, 0, MPI_COMM_WORLD);
+   MPI_Gather(&empty, 1, MPI_INT64_T, lengths, 
+      1, MPI_INT64_T, 0, MPI_COMM_WORLD);
 
    for(i = 0; i < readonly_nproc; i++) {
-      *total += lengths[i];
-      if (i > 0) displacements[i] = lengths[i - 1] + displacements[i - 1];
+      lengths[readonly_nproc + i] = total;
+      total += lengths[i];
    }
+
+   return(total);
 }
 
 
 
 /**
-   Receive the return values from the workers.
+   Start receiving the return values from the workers.
 
-   @param[out]  buffer          receiving buffer
-   @param[in]   lengths         total byte count per worker
-   @param[in]   displacements   displacement buffer per worker
-*/
-void receiveIncomingData(unsigned char *buffer, int *lengths, int *displacements) {
+   The return values of each worker are received directly into
+   its region of the receive buffer.
 
-   MPI_Gatherv(NULL, 0, MPI_BYTE, buffer, lengths, displacements,
-      MPI_BYTE, 0, MPI_COMM_WORLD);
+   @param[out]  buffer          receive buffer of the total byte count
+   @param[in]   lengths         byte counts and offsets per worker
+   @param[out]  requests        MPI request per worker
+*/
+void receiveIncomingData(unsigned char *buffer, int64_t *lengths, 
+                         MPI_Request *requests) {
+   int i;
 
+   requests[0] = MPI_REQUEST_NULL;
+   for(i = 1; i < readonly_nproc; i++) {
+      irecvBytes(buffer + lengths[readonly_nproc + i], lengths[i], i, 
+         TAG_RESULTS, MPI_COMM_WORLD, requests + i);
+      profileBytes(PROFILE_GATHER, lengths[i]);
+   }
 }
 
 
 /**
    Process the return values from the workers.
 
-   Unserialize the return values from the workers and 
+   Unserialize the return values from the workers as they arrive and 
    populate the R list with the values. The tasks processed by the
    supervisor have already been populated into the workerResultsList, and
-   they do not appear inside the data buffer.
+   they do not appear inside the buffer.
 
-   @param[in]  buffer              data buffer
-   @param[in]  lengths             number of bytes per worker
+   @param[in]  buffer              receive buffer of the total byte count
+   @param[in]  lengths             byte counts and offsets per worker
+   @param[in]  requests            MPI request per worker
    @param[out] workerResultsList   R list storing return values from workers
    @param[out] returnList          unlist() applied to workerResultsList
 
 */
-void processIncomingData(unsigned char *buffer, int *lengths, 
-                         SEXP workerResultsList, SEXP returnList) {
+void processIncomingData(unsigned char *buffer, int64_t *lengths,
+                         MPI_Request *requests, SEXP workerResultsList, 
+                         SEXP returnList) {
 
-   int i, j, offset = 0;
-   int currentLength, maxLength = 0;
-   SEXP serialList, unserializeCall;
-
-   PROTECT(unserializeCall = lang2(readonly_unserialize, R_NilValue));
+   int i, worker;
 
    for(i = 1; i < readonly_nproc; i++) {
-      if (lengths[i] > maxLength) maxLength = lengths[i];
+      MPI_Waitany(readonly_nproc, requests, &worker, MPI_STATUS_IGNORE);
+      SET_VECTOR_ELT(workerResultsList, worker, unserializeBytes(
+         buffer + lengths[readonly_nproc + worker], lengths[worker]));
    }
 
-   PROTECT(serialList = allocVector(RAWSXP, maxLength));
+   concatenateResults(workerResultsList, returnList);
+}
 
-   for(i = 1; i < readonly_nproc; i++) {
-      int nextSize = lengths[i];
-      SETLENGTH(serialList, nextSize);
-      memcpy(RAW(serialList), buffer + offset, nextSize);
-      SETCADR(unserializeCall, serialList);
-      SET_VECTOR_ELT(workerResultsList, i, eval(unserializeCall, R_GlobalEnv));
-      offset += nextSize;
-   }
+/**
+   Concatenate a list of result lists into a single list.
 
-   UNPROTECT(1);
+   The lists are concatenated in order, so that the results
+   appear in the same order as the tasks that produced them.
 
-   offset = 0;
-   for(i = 0; i < readonly_nproc; i++) {
-      SEXP nextList = VECTOR_ELT(workerResultsList, i);  
+   @param[in]  resultsList         R list of R lists of results
+   @param[out] returnList          unlist() applied to resultsList
+*/
+void concatenateResults(SEXP resultsList, SEXP returnList) {
+   int i, j, offset = 0;
+   int currentLength, numLists = LENGTH(resultsList);
+
+   for(i = 0; i < numLists; i++) {
+      SEXP nextList = VECTOR_ELT(resultsList, i);  
       currentLength = LENGTH(nextList);
       for(j = 0; j < currentLength; j++) {
          SET_VECTOR_ELT(returnList, offset, VECTOR_ELT(nextList, j));
          offset++;
       }
    }
+}
+
+/**
+   Unserialize an R raw vector.
+
+   Compressed payloads are decompressed first.
+
+   @param[in] serialized   R raw vector storing a serialized object,
+                           possibly compressed
+   @return                 the unserialized object (not protected)
+*/
+SEXP unserializeRaw(SEXP serialized) {
+   SEXP value;
+   int phase = profileEnter(PROFILE_UNSERIALIZE);
+
+   profileBytes(PROFILE_UNSERIALIZE, XLENGTH(serialized));
+   PROTECT(serialized = decompressPayload(serialized));
+   value = unserializeFromBytes(RAW(serialized), XLENGTH(serialized));
+   UNPROTECT(1);
+   profileLeave(phase);
+
+   return(value);
+}
+
+/**
+   Serialize an R object into an R raw vector.
+
+   The raw vector is compressed if compression is enabled and pays off.
+
+   @param[in] object       R object to serialize
+   @return                 R raw vector (not protected)
+*/
+SEXP serializeObject(SEXP object) {
+   SEXP value;
+   int phase = profileEnter(PROFILE_SERIALIZE);
+
+   value = compressPayload(serializeToRaw(object));
+   profileBytes(PROFILE_SERIALIZE, XLENGTH(value));
+   profileLeave(phase);
+
+   return(value);
+}
+
+/**
+   Serialize an R object for the supervisor.
+
+   @param[in] object       R object to serialize
+   @param[in] cached       R logical, TRUE if the object is broadcast 
+                           through the cache
+   @return                 R raw vector (not protected)
+*/
+SEXP serializePiebaldMPI(SEXP object, SEXP cached) {
+   if (asLogical(cached)) {
+      return(serializeCachedObject(object));
+   }
+   return(serializeObject(object));
+}
+
+/**
+   Evaluate lapply(args, theFunction, ...) where "..." is the remainder.
+
+   @param[in] args         R list of arguments to lapply
+   @param[in] theFunction  R function to apply
+   @param[in] remainder    R list of "..." arguments
+   @return                 R list of results (not protected)
+*/
+SEXP callLapply(SEXP args, SEXP theFunction, SEXP remainder) {
+   SEXP functionCall, value;
+   int phase = profileEnter(PROFILE_COMPUTE);
 
+   functionCall = Rf_VectorToPairList(remainder);
+
+   PROTECT(functionCall = LCONS(readonly_lapply, 
+             LCONS(args, LCONS(theFunction, functionCall))));
+   value = eval(functionCall, R_GlobalEnv);
    UNPROTECT(1);
+   profileLeave(phase);
+
+   return(value);
+}
+
+/**
+   Store a value in a list, growing the list when it is full.
+
+   The list grows geometrically. The caller must reprotect the list
+   that is returned, and truncate it to its final length when done.
+
+   @param[in] list         R list
+   @param[in] index        position at which to store the value
+   @param[in] value        R object to store
+   @return                 the R list storing the value (not protected)
+*/
+SEXP appendToList(SEXP list, int index, SEXP value) {
+   if (index >= LENGTH(list)) {
+      PROTECT(value);
+      list = lengthgets(list, 2 * LENGTH(list) + 1);
+      UNPROTECT(1);
+   }
+   SET_VECTOR_ELT(list, index, value);
+   return(list);
 }
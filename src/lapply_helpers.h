@@ -21,19 +21,32 @@
 #include <Rinternals.h>
 #include <Rdefines.h>
 #include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <stdint.h>
 
-void sendFunction(SEXP serializeFun);
-void sendRemainder(SEXP serializeRemainder);
-void sendRawByteCounts(int *lengths, SEXP serializeArgs, int *totalLength);
-void generateRawByteDisplacements(int *displacements, int *lengths);
-void sendArgRawBytes(int *displacements, int *lengths, int totalLength, 
-   SEXP serializeArgs);
+SEXP sendFunction(SEXP serializeFun);
+SEXP sendRemainder(SEXP serializeRemainder);
+void sendRawByteCounts(int64_t *lengths, SEXP serializeArgs);
+void sendArgRawBytes(int64_t *lengths, SEXP serializeArgs);
+void sendTypedArgs(SEXP input, SEXP argBase, SEXP argCount);
+int argumentEncoding(SEXP args);
+SEXP localArgs(SEXP args, SEXP argBase, SEXP argCount);
+int sumCounts(SEXP argCount);
 
-void evaluateLocalWork(SEXP function, SEXP serializeArgs, SEXP serializeRemainder, SEXP returnList);
+void evaluateLocalWork(SEXP theFunction, SEXP args, SEXP argBase,
+   SEXP argCount, SEXP remainder, SEXP returnList);
 
-void receiveIncomingLengths(int *lengths, int *displacements, int *total);
-void receiveIncomingData(unsigned char *buffer, int *lengths, int *displacements);
-void processIncomingData(unsigned char *buffer, int *lengths, 
-   SEXP workerResultsList, SEXP returnList);
+R_xlen_t receiveIncomingLengths(int64_t *lengths);
+void receiveIncomingData(unsigned char *buffer, int64_t *lengths, 
+   MPI_Request *requests);
+void processIncomingData(unsigned char *buffer, int64_t *lengths,
+   MPI_Request *requests, SEXP workerResultsList, SEXP returnList);
+void concatenateResults(SEXP resultsList, SEXP returnList);
+
+SEXP unserializeRaw(SEXP serialized);
+SEXP serializeObject(SEXP object);
+SEXP serializePiebaldMPI(SEXP object, SEXP cached);
+SEXP callLapply(SEXP args, SEXP theFunction, SEXP remainder);
+SEXP appendToList(SEXP list, int index, SEXP value);
 
 #endif //_lapply_helpers_h
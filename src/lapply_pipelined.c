@@ -0,0 +1,113 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply.h"
+#include "lapply_helpers.h"
+#include "lapply_workers_helpers.h"
+#include "lapply_dynamic_helpers.h"
+#include "lapply_pipelined_helpers.h"
+
+
+SEXP lapplyPipelinedPiebaldMPI(SEXP serializeFun, SEXP segmentFun, 
+      SEXP serializeRemainder, SEXP argBase, SEXP argCount, 
+      SEXP subChunkLength, SEXP argLength) {
+
+   checkPiebaldInit();
+
+   int length = INTEGER(argLength)[0];
+   SEXP workerResultsList, returnList;
+   SEXP theFunction, remainder;
+
+   PROTECT(workerResultsList = allocVector(VECSXP, readonly_nproc));
+   PROTECT(returnList = allocVector(VECSXP, length));
+
+   sendCommand(LAPPLY_PIPELINED);
+
+   PROTECT(theFunction = sendFunction(serializeFun));
+
+   PROTECT(remainder = sendRemainder(serializeRemainder));
+
+   SET_VECTOR_ELT(workerResultsList, 0, sendPipelinedArgs(segmentFun, 
+      argBase, argCount, subChunkLength, theFunction, remainder));
+
+   lapplyPiebaldMPI_doReceive(workerResultsList, returnList);
+
+   UNPROTECT(4);
+
+   return(returnList);
+}
+
+
+void lapplyPipelinedWorkerPiebaldMPI() {
+   int numResults = 0, arrived;
+   int64_t currentHeader[2], nextHeader[2];
+   SEXP theFunction, remainder, args, returnList;
+   SEXP currentChunk, nextChunk, resultsList;
+   MPI_Request request, headerRequest;
+   PROTECT_INDEX currentIndex, nextIndex, resultsIndex;
+
+   theFunction = findFunction();
+
+   remainder = workerGetRemainder();
+
+   PROTECT_WITH_INDEX(currentChunk = workerReceiveChunk(currentHeader), 
+      &currentIndex);
+   PROTECT_WITH_INDEX(nextChunk = R_NilValue, &nextIndex);
+   PROTECT_WITH_INDEX(resultsList = allocVector(VECSXP, 1), &resultsIndex);
+
+   while(currentChunk != R_NilValue) {
+      // The supervisor may be busy with its own work, so only
+      // prefetch the next sub-chunk if it has already been announced.
+      workerPostChunkHeader(nextHeader, &headerRequest);
+      MPI_Test(&headerRequest, &arrived, MPI_STATUS_IGNORE);
+      if (arrived) {
+         REPROTECT(nextChunk = workerStartChunk(nextHeader, &request), 
+            nextIndex);
+      }
+
+      PROTECT(args = unserializeRaw(currentChunk));
+      REPROTECT(resultsList = appendToList(resultsList, numResults, 
+         callLapply(args, theFunction, remainder)), resultsIndex);
+      numResults++;
+      UNPROTECT(1);
+
+      if (!arrived) {
+         MPI_Wait(&headerRequest, MPI_STATUS_IGNORE);
+         REPROTECT(nextChunk = workerStartChunk(nextHeader, &request), 
+            nextIndex);
+      }
+
+      MPI_Wait(&request, MPI_STATUS_IGNORE);
+      currentHeader[0] = nextHeader[0];
+      currentHeader[1] = nextHeader[1];
+      REPROTECT(currentChunk = nextChunk, currentIndex);
+   }
+
+   PROTECT(returnList = flattenSubChunkResults(resultsList, numResults));
+
+   sendReturnList(returnList);
+
+   UNPROTECT(6);
+}
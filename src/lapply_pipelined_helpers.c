@@ -0,0 +1,344 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply_helpers.h"
+#include "lapply_pipelined_helpers.h"
+#include "bigcount.h"
+
+/**
+   Allocate the send slots of the supervisor.
+
+   The list of in-flight sub-chunks is not protected, the caller
+   must protect pipeline->inFlight.
+
+   @param[out] pipeline     the send slots to initialize
+   @param[in]  numSlots     maximum number of sub-chunks in flight
+*/
+void initSendPipeline(SendPipeline *pipeline, int numSlots) {
+   int i;
+
+   pipeline->numSlots = numSlots;
+   pipeline->headers  = Calloc(2 * numSlots, int64_t);
+   pipeline->requests = Calloc(2 * numSlots, MPI_Request);
+   pipeline->inFlight = allocVector(VECSXP, numSlots);
+
+   for(i = 0; i < 2 * numSlots; i++) {
+      pipeline->requests[i] = MPI_REQUEST_NULL;
+   }
+}
+
+/**
+   Wait for all outstanding sends and release the send slots.
+
+   @param[in] pipeline     the send slots to release
+*/
+void freeSendPipeline(SendPipeline *pipeline) {
+   MPI_Waitall(2 * pipeline->numSlots, pipeline->requests, 
+      MPI_STATUSES_IGNORE);
+   Free(pipeline->headers);
+   Free(pipeline->requests);
+}
+
+/**
+   Find a send slot whose sends have completed, without blocking.
+
+   The sub-chunk previously held by the slot is released.
+
+   @param[in,out] pipeline  the send slots
+   @return                  index of a free slot, or -1 if all slots are busy
+*/
+int findFreeSlot(SendPipeline *pipeline) {
+   int slot, flag;
+
+   for(slot = 0; slot < pipeline->numSlots; slot++) {
+      MPI_Testall(2, pipeline->requests + 2 * slot, &flag, 
+         MPI_STATUSES_IGNORE);
+      if (flag) {
+         SET_VECTOR_ELT(pipeline->inFlight, slot, R_NilValue);
+         return(slot);
+      }
+   }
+
+   return(-1);
+}
+
+/**
+   Block until a send slot becomes free.
+
+   The sub-chunk previously held by the slot is released.
+
+   @param[in,out] pipeline  the send slots
+   @return                  index of a free slot
+*/
+int waitFreeSlot(SendPipeline *pipeline) {
+   int index, slot;
+
+   MPI_Waitany(2 * pipeline->numSlots, pipeline->requests, &index, 
+      MPI_STATUS_IGNORE);
+   slot = index / 2;
+   MPI_Waitall(2, pipeline->requests + 2 * slot, MPI_STATUSES_IGNORE);
+   SET_VECTOR_ELT(pipeline->inFlight, slot, R_NilValue);
+
+   return(slot);
+}
+
+/**
+   Initialize the progress of each rank through its slice of the input.
+
+   @param[out] progress        the progress to initialize
+   @param[in]  argBase         R integer vector of 1-based slice offsets
+   @param[in]  argCount        R integer vector of slice lengths
+   @param[in]  subChunkLength  R integer maximum elements per sub-chunk
+*/
+void initPipelineProgress(PipelineProgress *progress, SEXP argBase, 
+   SEXP argCount, SEXP subChunkLength) {
+
+   int i;
+
+   progress->subChunkLength = INTEGER(subChunkLength)[0];
+   progress->activeWorkers  = readonly_nproc - 1;
+   progress->nextBase       = Calloc(readonly_nproc, int);
+   progress->remaining      = Calloc(readonly_nproc, int);
+   progress->nextIndex      = Calloc(readonly_nproc, int);
+
+   for(i = 0; i < readonly_nproc; i++) {
+      progress->nextBase[i]  = INTEGER(argBase)[i];
+      progress->remaining[i] = INTEGER(argCount)[i];
+   }
+}
+
+/**
+   Release the progress of each rank.
+
+   @param[in] progress     the progress to release
+*/
+void freePipelineProgress(PipelineProgress *progress) {
+   Free(progress->nextBase);
+   Free(progress->remaining);
+   Free(progress->nextIndex);
+}
+
+/**
+   Extract the next sub-chunk of a rank's slice of the input.
+
+   @param[in,out] progress     progress of each rank
+   @param[in]     rank         rank whose slice is consumed
+   @param[in]     segmentFun   R function(base, length) returning a segment
+   @return                     R segment of the input (not protected)
+*/
+SEXP nextSubChunk(PipelineProgress *progress, int rank, SEXP segmentFun) {
+   int length = progress->remaining[rank];
+   SEXP segmentCall, segment;
+
+   if (length > progress->subChunkLength) {
+      length = progress->subChunkLength;
+   }
+
+   PROTECT(segmentCall = lang3(segmentFun, R_NilValue, R_NilValue));
+   SETCADR(segmentCall, ScalarInteger(progress->nextBase[rank]));
+   SETCADDR(segmentCall, ScalarInteger(length));
+   segment = eval(segmentCall, R_GlobalEnv);
+   UNPROTECT(1);
+
+   progress->nextBase[rank]  += length;
+   progress->remaining[rank] -= length;
+   progress->nextIndex[rank]++;
+
+   return(segment);
+}
+
+/**
+   Serialize the next sub-chunk for a worker and start sending it.
+
+   When the worker's slice is exhausted, the worker is sent a terminating
+   header instead and is no longer active.
+
+   @param[in,out] pipeline     the send slots
+   @param[in,out] progress     progress of each rank
+   @param[in]     slot         index of a free send slot
+   @param[in]     worker       rank of the worker process
+   @param[in]     segmentFun   R function(base, length) returning a segment
+*/
+void sendSubChunk(SendPipeline *pipeline, PipelineProgress *progress, 
+   int slot, int worker, SEXP segmentFun) {
+
+   int64_t *header = pipeline->headers + 2 * slot;
+   MPI_Request *requests = pipeline->requests + 2 * slot;
+   SEXP serialized;
+
+   if (progress->remaining[worker] == 0) {
+      header[0] = -1;
+      header[1] = 0;
+      progress->remaining[worker] = -1;
+      progress->activeWorkers--;
+      MPI_Isend(header, 2, MPI_INT64_T, worker, TAG_CHUNK_HEADER, 
+         MPI_COMM_WORLD, requests);
+      return;
+   }
+
+   header[0] = progress->nextIndex[worker];
+   PROTECT(serialized = nextSubChunk(progress, worker, segmentFun));
+   serialized = serializeObject(serialized);
+   SET_VECTOR_ELT(pipeline->inFlight, slot, serialized);
+   UNPROTECT(1);
+   header[1] = XLENGTH(serialized);
+
+   MPI_Isend(header, 2, MPI_INT64_T, worker, TAG_CHUNK_HEADER, 
+      MPI_COMM_WORLD, requests);
+   isendBytes(RAW(serialized), header[1], worker, TAG_CHUNK_DATA,
+      MPI_COMM_WORLD, requests + 1);
+}
+
+/**
+   Find the next worker, in round-robin order, that has not been terminated.
+
+   @param[in] progress     progress of each rank
+   @param[in] worker       rank of the previous worker (0 to start)
+   @return                 rank of the next worker, or -1 if none remain
+*/
+int nextActiveWorker(PipelineProgress *progress, int worker) {
+   int i, candidate;
+
+   if (progress->activeWorkers == 0) {
+      return(-1);
+   }
+
+   for(i = 1; i < readonly_nproc; i++) {
+      candidate = (worker + i - 1) % (readonly_nproc - 1) + 1;
+      if (progress->remaining[candidate] >= 0) {
+         return(candidate);
+      }
+   }
+
+   return(-1);
+}
+
+/**
+   Evaluate the next sub-chunk of the supervisor's own slice.
+
+   @param[in,out] progress     progress of each rank
+   @param[in]     segmentFun   R function(base, length) returning a segment
+   @param[in]     theFunction  R function
+   @param[in]     remainder    R list of "..." args
+   @return                     R list of results (not protected)
+*/
+SEXP evaluateLocalSubChunk(PipelineProgress *progress, SEXP segmentFun,
+   SEXP theFunction, SEXP remainder) {
+
+   SEXP args, results;
+
+   PROTECT(args = nextSubChunk(progress, 0, segmentFun));
+   results = callLapply(args, theFunction, remainder);
+   UNPROTECT(1);
+
+   return(results);
+}
+
+/**
+   Concatenate the first numLists result lists of a list.
+
+   @param[in] resultsList   R list of R lists of results
+   @param[in] numLists      number of result lists in use
+   @return                  R list of results (not protected)
+*/
+SEXP flattenSubChunkResults(SEXP resultsList, int numLists) {
+   int i, total = 0;
+   SEXP returnList;
+
+   PROTECT(resultsList = lengthgets(resultsList, numLists));
+   for(i = 0; i < numLists; i++) {
+      total += LENGTH(VECTOR_ELT(resultsList, i));
+   }
+
+   PROTECT(returnList = allocVector(VECSXP, total));
+   concatenateResults(resultsList, returnList);
+   UNPROTECT(2);
+
+   return(returnList);
+}
+
+/**
+   Send every worker its slice of the input as a stream of sub-chunks.
+
+   The supervisor serializes a sub-chunk only when a send slot is free,
+   so at most PIPELINE_IN_FLIGHT serialized sub-chunks exist at any time.
+   While all slots are busy, the supervisor evaluates sub-chunks of
+   its own slice instead of waiting.
+
+   @param[in] segmentFun      R function(base, length) returning a segment
+   @param[in] argBase         R integer vector of 1-based slice offsets
+   @param[in] argCount        R integer vector of slice lengths
+   @param[in] subChunkLength  R integer maximum elements per sub-chunk
+   @param[in] theFunction     R function
+   @param[in] remainder       R list of "..." args
+   @return                    R list of the supervisor's results 
+                              (not protected)
+*/
+SEXP sendPipelinedArgs(SEXP segmentFun, SEXP argBase, SEXP argCount, 
+   SEXP subChunkLength, SEXP theFunction, SEXP remainder) {
+
+   int slot, worker, numLocal = 0;
+   SEXP localResults;
+   SendPipeline pipeline;
+   PipelineProgress progress;
+   PROTECT_INDEX localIndex;
+
+   initSendPipeline(&pipeline, PIPELINE_IN_FLIGHT);
+   PROTECT(pipeline.inFlight);
+   PROTECT_WITH_INDEX(localResults = allocVector(VECSXP, 1), &localIndex);
+
+   initPipelineProgress(&progress, argBase, argCount, subChunkLength);
+
+   worker = nextActiveWorker(&progress, 0);
+   while(worker > 0) {
+      slot = findFreeSlot(&pipeline);
+      if (slot < 0 && progress.remaining[0] > 0) {
+         REPROTECT(localResults = appendToList(localResults, numLocal,
+            evaluateLocalSubChunk(&progress, segmentFun, theFunction, 
+               remainder)), localIndex);
+         numLocal++;
+         continue;
+      } else if (slot < 0) {
+         slot = waitFreeSlot(&pipeline);
+      }
+      sendSubChunk(&pipeline, &progress, slot, worker, segmentFun);
+      worker = nextActiveWorker(&progress, worker);
+   }
+
+   while(progress.remaining[0] > 0) {
+      REPROTECT(localResults = appendToList(localResults, numLocal,
+         evaluateLocalSubChunk(&progress, segmentFun, theFunction, 
+            remainder)), localIndex);
+      numLocal++;
+   }
+
+   freeSendPipeline(&pipeline);
+   freePipelineProgress(&progress);
+
+   localResults = flattenSubChunkResults(localResults, numLocal);
+   UNPROTECT(2);
+
+   return(localResults);
+}
@@ -0,0 +1,72 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _lapply_pipelined_helpers_h
+#define _lapply_pipelined_helpers_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+// Maximum number of serialized sub-chunks held by the supervisor at once.
+#define PIPELINE_IN_FLIGHT 4
+
+/*
+ * Send slots of the supervisor. A slot holds one serialized sub-chunk
+ * (or a terminating header) until both of its sends have completed.
+ * Sub-chunks use the same { index, length } headers as the dynamic 
+ * schedule, so that the workers can share the receiving code.
+ */
+typedef struct {
+   int numSlots;
+   int64_t *headers;
+   MPI_Request *requests;
+   SEXP inFlight;
+} SendPipeline;
+
+/*
+ * Progress of the distribution of each rank's slice of the input.
+ */
+typedef struct {
+   int subChunkLength;
+   int activeWorkers;
+   int *nextBase;
+   int *remaining;
+   int *nextIndex;
+} PipelineProgress;
+
+void initSendPipeline(SendPipeline *pipeline, int numSlots);
+void freeSendPipeline(SendPipeline *pipeline);
+int findFreeSlot(SendPipeline *pipeline);
+int waitFreeSlot(SendPipeline *pipeline);
+
+void initPipelineProgress(PipelineProgress *progress, SEXP argBase, 
+   SEXP argCount, SEXP subChunkLength);
+void freePipelineProgress(PipelineProgress *progress);
+SEXP nextSubChunk(PipelineProgress *progress, int rank, SEXP segmentFun);
+void sendSubChunk(SendPipeline *pipeline, PipelineProgress *progress, 
+   int slot, int worker, SEXP segmentFun);
+int nextActiveWorker(PipelineProgress *progress, int worker);
+SEXP evaluateLocalSubChunk(PipelineProgress *progress, SEXP segmentFun,
+   SEXP theFunction, SEXP remainder);
+SEXP flattenSubChunkResults(SEXP resultsList, int numLists);
+
+SEXP sendPipelinedArgs(SEXP segmentFun, SEXP argBase, SEXP argCount, 
+   SEXP subChunkLength, SEXP theFunction, SEXP remainder);
+
+#endif // _lapply_pipelined_helpers_h
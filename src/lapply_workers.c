@@ -23,21 +23,18 @@
 
 
 void lapplyWorkerPiebaldMPI() {
-   SEXP serializeRemainder, serializeArgs;
-   SEXP returnList, serializeFunction;
+   SEXP remainder, args;
+   SEXP returnList, theFunction;
 
-   serializeFunction = findFunction();
+   theFunction = findFunction();
    
-   serializeRemainder = workerGetRemainder();
+   remainder = workerGetRemainder();
 
-   serializeArgs = workerGetArgs();
+   args = workerReceiveArgs();
    
-   returnList = generateReturnList(serializeFunction, 
-      serializeRemainder, serializeArgs);
+   returnList = evaluateReturnList(theFunction, remainder, args);
 
    sendReturnList(returnList);
 
-   workerCleanup(serializeFunction, serializeRemainder, serializeArgs, returnList);
+   workerCleanup(theFunction, remainder, args, returnList);
 }
-
-
@@ -19,27 +19,38 @@
 #include <Rdefines.h>
 #include <R_ext/Rdynload.h>
 #include <mpi.h>
+#include <string.h>
 
 #include "init_finalize.h"
 #include "commands.h"
 #include "state.h"
 #include "lapply_helpers.h"
+#include "cache.h"
+#include "export.h"
+#include "typed.h"
+#include "hierarchy.h"
+#include "bigcount.h"
+#include "profile.h"
+#include "compress.h"
+#include "serialize.h"
+#include "shared.h"
+#include "pool.h"
+#include "lapply_workers_helpers.h"
 #include "compiler_directives.h"
 
 
 /**
-   Receive the serialized function from the supervisor.
+   Receive the function from the supervisor.
+
+   The function is taken from the cache when the supervisor 
+   only broadcasts its digest, and it is bound to the exports.
 
    @return  R function language object
 */
 SEXP findFunction() {
-   int length;
    SEXP function;
 
-   MPI_Bcast(&length, 1, MPI_INT, 0, MPI_COMM_WORLD);
-   PROTECT(function = allocVector(RAWSXP, length));
-   MPI_Bcast((void*) RAW(function), length, 
-      MPI_BYTE, 0, MPI_COMM_WORLD);
+   PROTECT(function = bindExports(receiveCachedObject()));
 
    return(function);
 }
@@ -47,16 +58,15 @@ SEXP findFunction() {
 /**
    Receive the "..." arguments from the supervisor.
 
-   @return  R serialized object storing the "..." arguments
+   The arguments are taken from the cache when the supervisor 
+   only broadcasts their digest.
+
+   @return  R list storing the "..." arguments
 */
 SEXP workerGetRemainder() {
-   int length;
    SEXP remainder;
 
-   MPI_Bcast(&length, 1, MPI_INT, 0, MPI_COMM_WORLD);
-   PROTECT(remainder = allocVector(RAWSXP, length));
-   MPI_Bcast((void*) RAW(remainder), length, 
-      MPI_BYTE, 0, MPI_COMM_WORLD);
+   PROTECT(remainder = receiveCachedObject());
 
    return(remainder);
 }
@@ -64,64 +74,92 @@ SEXP workerGetRemainder() {
 /**
    Receive the task arguments from the supervisor.
 
-   @return  R serialized object storing the arguments to lapply.
+   The arguments are received into the pooled receive buffer and
+   unserialized from there.
+
+   @return  R list of arguments to lapply.
 */
 SEXP workerGetArgs() {
+   int64_t length;
+   unsigned char *buffer;
+   SEXP args;
+
+   MPI_Scatter(NULL, 0, MPI_INT64_T, &length, 1, MPI_INT64_T, 0, 
+      MPI_COMM_WORLD);
+
+   buffer = poolBuffer(POOL_RECEIVE, length);
+   recvBytes(buffer, length, 0, TAG_ARGS, MPI_COMM_WORLD);
+   profileBytes(PROFILE_SCATTER, length);
+
+   PROTECT(args = unserializeBytes(buffer, length));
+   releasePoolBuffer(POOL_RECEIVE);
+
+   return(args);
+}
+
+/**
+   Receive the task arguments from the supervisor as a typed vector.
+
+   @param[in] type  R vector type of the arguments
+   @return  R logical, integer, double or complex vector of arguments.
+*/
+SEXP workerGetTypedArgs(int type) {
    int length;
    SEXP args;
-   unsigned char *buffer;
 
    MPI_Scatter(NULL, 0, MPI_INT, &length, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-   buffer = Calloc(length, unsigned char);
-
-   MPI_Scatterv(NULL, NULL, NULL, MPI_BYTE, buffer, length, 
-      MPI_BYTE, 0, MPI_COMM_WORLD);
+   PROTECT(args = allocVector(type, length));
 
-   PROTECT(args = allocVector(RAWSXP, length));
-   memcpy(RAW(args), buffer, length);
+   MPI_Recv(typedDataPointer(args), length, typedDatatype(type), 0, 
+      TAG_ARGS, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+   profileBytes(PROFILE_SCATTER, (double) length * typedElementSize(type));
 
    return(args);
 }
 
 /**
-   Evaluate the function and generate return list.
+   Receive the task arguments from the supervisor in either encoding.
 
-   @param[in] serializedFunction   R serialized function language object
-   @param[in] serializeRemainder   R serialized "..." arguments to lapply
-   @param[in] serializeArgs        R serialized arguments to lapply
-   @return                         R serialized object storing the return list.
+   @return  R list or vector of arguments to lapply.
 */
-SEXP generateReturnList(SEXP serializedFunction, SEXP serializeRemainder, 
-                        SEXP serializeArgs) {
-
-   SEXP serializeCall, unserializeCall, theFunction, functionCall;
-   SEXP args, remainder;
-   SEXP returnList;
+SEXP workerReceiveArgs() {
+   int encoding;
+   int phase = profileEnter(PROFILE_SCATTER);
+   SEXP args;
 
-   PROTECT(unserializeCall = lang2(readonly_unserialize, R_NilValue));
-   PROTECT(serializeCall   = lang3(readonly_serialize, R_NilValue, R_NilValue));
+   MPI_Bcast(&encoding, 1, MPI_INT, 0, MPI_COMM_WORLD);
 
-   SETCADR(unserializeCall, serializeRemainder);
-   PROTECT(remainder = eval(unserializeCall, R_GlobalEnv));
+   if (encoding != RAWSXP) {
+      args = workerGetTypedArgs(encoding);
+      profileLeave(phase);
+      return(args);
+   }
 
-   SETCADR(unserializeCall, serializedFunction);
-   PROTECT(theFunction = eval(unserializeCall, R_GlobalEnv));
+   if (readonly_hierarchical) {
+      PROTECT(args = workerHierarchicalReceiveArgs());
+      profileLeave(phase);
+      return(args);
+   }
 
-   SETCADR(unserializeCall, serializeArgs);
-   PROTECT(args = eval(unserializeCall, R_GlobalEnv));
+   args = workerGetArgs();
+   profileLeave(phase);
 
-   functionCall = Rf_VectorToPairList(remainder);
+   return(args);
+}
 
-   PROTECT(functionCall = LCONS(readonly_lapply, 
-                             LCONS(args, LCONS(theFunction, functionCall))));
+/**
+   Evaluate the function on unserialized arguments and generate return list.
 
-   SETCADR(serializeCall, eval(functionCall, R_GlobalEnv));
+   @param[in] theFunction          R function language object
+   @param[in] remainder            R list of "..." arguments to lapply
+   @param[in] args                 R list or vector of arguments to lapply
+   @return                         R list of return values.
+*/
+SEXP evaluateReturnList(SEXP theFunction, SEXP remainder, SEXP args) {
+   SEXP returnList;
 
-   returnList = eval(serializeCall, R_GlobalEnv);
-   UNPROTECT(6);
-   
-   PROTECT(returnList);
+   PROTECT(returnList = callLapply(args, theFunction, remainder));
 
    return(returnList);
 }
@@ -130,26 +168,80 @@ SEXP generateReturnList(SEXP serializedFunction, SEXP serializeRemainder,
 /**
    Send the serialized return list to the supervisor process.
 
-   @param[in] returnList       R serialized object storing the return list.
+   @param[in] serialResults    R raw vector storing the return list.
 */
-void sendReturnList(SEXP returnList) {
-   int length;
+static void sendSerializedReturnList(SEXP serialResults) {
+   int64_t length = XLENGTH(serialResults);
+   int phase = profileEnter(PROFILE_GATHER);
 
-   length = LENGTH(returnList);
+   profileBytes(PROFILE_GATHER, length);
 
-   MPI_Gather(&length, 1, MPI_INT, NULL, 0, MPI_INT, 0, MPI_COMM_WORLD);
+   if (readonly_hierarchical) {
+      workerHierarchicalSendResults(serialResults);
+      profileLeave(phase);
+      return;
+   }
 
-   MPI_Gatherv(RAW(returnList), length, MPI_BYTE, 
-      NULL, 0, NULL, MPI_BYTE, 0, MPI_COMM_WORLD);
+   MPI_Gather(&length, 1, MPI_INT64_T, NULL, 0, MPI_INT64_T, 0, 
+      MPI_COMM_WORLD);
+
+   sendBytes(RAW(serialResults), length, 0, TAG_RESULTS, MPI_COMM_WORLD);
+   profileLeave(phase);
+}
+
+/**
+   Serialize the return list and send it to the supervisor process.
+
+   The return list is serialized once, into the pooled send buffer.
+   The length of the serialized bytes then decides whether they are
+   compressed, copied into a raw vector for the node leaders, or sent
+   straight from the buffer.
+
+   @param[in] returnList       R list of return values.
+*/
+void sendReturnList(SEXP returnList) {
+   int64_t length;
+   unsigned char *buffer;
+   SEXP payload;
+   int phase = profileEnter(PROFILE_SERIALIZE);
+
+   length = serializeToPool(returnList, POOL_SEND);
+   buffer = poolBuffer(POOL_SEND, length);
+   PROTECT(payload = compressBytes(buffer, length));
+   if (payload == R_NilValue && readonly_hierarchical) {
+      payload = allocVector(RAWSXP, length);
+      memcpy(RAW(payload), buffer, length);
+      UNPROTECT(1);
+      PROTECT(payload);
+   }
+   profileBytes(PROFILE_SERIALIZE, 
+      payload == R_NilValue ? length : XLENGTH(payload));
+   profileLeave(phase);
+
+   if (payload != R_NilValue) {
+      releasePoolBuffer(POOL_SEND);
+      sendSerializedReturnList(payload);
+      UNPROTECT(1);
+      return;
+   }
+   UNPROTECT(1);
+
+   phase = profileEnter(PROFILE_GATHER);
+   profileBytes(PROFILE_GATHER, length);
+   MPI_Gather(&length, 1, MPI_INT64_T, NULL, 0, MPI_INT64_T, 0, 
+      MPI_COMM_WORLD);
+   sendBytes(buffer, length, 0, TAG_RESULTS, MPI_COMM_WORLD);
+   releasePoolBuffer(POOL_SEND);
+   profileLeave(phase);
 }
 
 
 /**
    Cleanup any variables that live on the protect stack.
 
-   @param[in] serializeFunction   R serialized function language object
-   @param[in] serializeRemainder  R serialized "..." arguments to lapply
-   @param[in] serializeArgs       R serialized arguments to lapply
+   @param[in] serializeFunction   R function language object
+   @param[in] serializeRemainder  R list of "..." arguments to lapply
+   @param[in] serializeArgs       R arguments to lapply
    @param[in] returnList          R serialized object storing the return list.
 */
 void workerCleanup(SEXP serializeFunction COMPILER_DIRECTIVE_UNUSED,
@@ -27,13 +27,15 @@
 #include "commands.h"
 #include "state.h"
 #include "lapply_helpers.h"
+#include "cache.h"
 #include "compiler_directives.h"
 
 SEXP findFunction();
 SEXP workerGetRemainder();
 SEXP workerGetArgs();
-SEXP generateReturnList(SEXP theFunction, SEXP serializeRemainder, 
-                        SEXP serializeArgs);
+SEXP workerGetTypedArgs(int type);
+SEXP workerReceiveArgs();
+SEXP evaluateReturnList(SEXP theFunction, SEXP remainder, SEXP args);
 void sendReturnList(SEXP returnList);
 void workerCleanup(SEXP serializeFunction, SEXP serializeRemainder, 
                    SEXP serializeArgs, SEXP returnList);
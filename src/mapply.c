@@ -0,0 +1,138 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * A parallel mapply scatters every vector argument with the same
+ * partition, one slice per argument, so that each process holds the
+ * aligned elements of its tasks. Atomic arguments use the typed scatter.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply.h"
+#include "lapply_helpers.h"
+#include "lapply_workers_helpers.h"
+#include "mapply.h"
+#include "profile.h"
+
+/**
+   Evaluate mapply(theFunction, slices..., MoreArgs = moreArgs, 
+   SIMPLIFY = FALSE, USE.NAMES = FALSE).
+
+   @param[in] slices       R list of the aligned slices of every argument
+   @param[in] theFunction  R function to apply
+   @param[in] remainder    R list of the argument names and MoreArgs
+   @return                 R list of results (not protected)
+*/
+static SEXP callMapply(SEXP slices, SEXP theFunction, SEXP remainder) {
+   int i;
+   SEXP argNames = VECTOR_ELT(remainder, 0);
+   SEXP functionCall, tail, value;
+   PROTECT_INDEX index;
+   int phase = profileEnter(PROFILE_COMPUTE);
+
+   PROTECT_WITH_INDEX(tail = CONS(ScalarLogical(FALSE), R_NilValue), 
+      &index);
+   SET_TAG(tail, install("USE.NAMES"));
+   REPROTECT(tail = CONS(ScalarLogical(FALSE), tail), index);
+   SET_TAG(tail, install("SIMPLIFY"));
+   REPROTECT(tail = CONS(VECTOR_ELT(remainder, 1), tail), index);
+   SET_TAG(tail, install("MoreArgs"));
+
+   for(i = LENGTH(slices) - 1; i >= 0; i--) {
+      REPROTECT(tail = CONS(VECTOR_ELT(slices, i), tail), index);
+      if (argNames != R_NilValue && 
+         CHAR(STRING_ELT(argNames, i))[0] != '\0') {
+         SET_TAG(tail, install(translateChar(STRING_ELT(argNames, i))));
+      }
+   }
+
+   PROTECT(functionCall = LCONS(readonly_mapply, LCONS(theFunction, tail)));
+   value = eval(functionCall, R_GlobalEnv);
+   UNPROTECT(2);
+   profileLeave(phase);
+
+   return(value);
+}
+
+
+SEXP mapplyPiebaldMPI(SEXP serializeFun, SEXP args, 
+      SEXP serializeRemainder, SEXP argBase, SEXP argCount) {
+
+   checkPiebaldInit();
+
+   int i, numArgs = LENGTH(args);
+   int length = sumCounts(argCount);
+   SEXP workerResultsList, returnList;
+   SEXP theFunction, remainder, slices;
+
+   PROTECT(workerResultsList = allocVector(VECSXP, readonly_nproc));
+   PROTECT(returnList = allocVector(VECSXP, length));
+
+   sendCommand(MAPPLY);
+
+   PROTECT(theFunction = sendFunction(serializeFun));
+
+   PROTECT(remainder = sendRemainder(serializeRemainder));
+
+   MPI_Bcast(&numArgs, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+   PROTECT(slices = allocVector(VECSXP, numArgs));
+   for(i = 0; i < numArgs; i++) {
+      lapplyPiebaldMPI_doSend(VECTOR_ELT(args, i), argBase, argCount);
+      SET_VECTOR_ELT(slices, i, 
+         localArgs(VECTOR_ELT(args, i), argBase, argCount));
+   }
+
+   SET_VECTOR_ELT(workerResultsList, 0, 
+      callMapply(slices, theFunction, remainder));
+
+   lapplyPiebaldMPI_doReceive(workerResultsList, returnList);
+
+   UNPROTECT(5);
+
+   return(returnList);
+}
+
+
+void mapplyWorkerPiebaldMPI() {
+   int i, numArgs;
+   SEXP theFunction, remainder, slices, returnList;
+
+   theFunction = findFunction();
+
+   remainder = workerGetRemainder();
+
+   MPI_Bcast(&numArgs, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+   PROTECT(slices = allocVector(VECSXP, numArgs));
+   for(i = 0; i < numArgs; i++) {
+      SET_VECTOR_ELT(slices, i, workerReceiveArgs());
+      UNPROTECT(1);
+   }
+
+   PROTECT(returnList = callMapply(slices, theFunction, remainder));
+
+   sendReturnList(returnList);
+
+   UNPROTECT(4);
+}
@@ -0,0 +1,349 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Map and reduce. Every process folds the results of its own tasks,
+ * and only the partial reductions travel, so the supervisor never 
+ * holds the individual results. REDUCE must be associative: the
+ * partials are combined in rank order, but grouped differently 
+ * than by a sequential Reduce().
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <limits.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply.h"
+#include "lapply_helpers.h"
+#include "lapply_workers_helpers.h"
+#include "cache.h"
+#include "mapreduce.h"
+#include "bigcount.h"
+
+/**
+   Evaluate Reduce(theReduction, values).
+
+   @param[in] theReduction R function of two arguments
+   @param[in] values       R list of values
+   @return                 the reduced value, or NULL for an empty
+                           list (not protected)
+*/
+static SEXP callReduce(SEXP theReduction, SEXP values) {
+   SEXP functionCall, value;
+
+   PROTECT(functionCall = lang3(readonly_reduce, theReduction, values));
+   value = eval(functionCall, R_GlobalEnv);
+   UNPROTECT(1);
+
+   return(value);
+}
+
+/**
+   Combine two partial reductions, lower ranks first.
+
+   @param[in] theReduction R function of two arguments
+   @param[in] left         R partial reduction of the lower ranks
+   @param[in] right        R partial reduction of the higher ranks
+   @return                 the combined value (not protected)
+*/
+static SEXP combinePartials(SEXP theReduction, SEXP left, SEXP right) {
+   SEXP values;
+
+   PROTECT(values = allocVector(VECSXP, 2));
+   SET_VECTOR_ELT(values, 0, left);
+   SET_VECTOR_ELT(values, 1, right);
+   values = callReduce(theReduction, values);
+   UNPROTECT(1);
+
+   return(values);
+}
+
+/**
+   Test whether a partial reduction can be combined with MPI_Reduce.
+
+   Only double vectors without attributes and without NA or NaN
+   are combined natively, as the MPI operations do not follow the
+   R semantics of missing values and integer overflow. The binary 
+   max() and min() return a scalar, so they are only elementwise 
+   for partials of length one.
+
+   @param[in] partial      R partial reduction
+   @param[in] operation    builtin reduction
+   @return                 TRUE if MPI_Reduce gives the same value
+*/
+static int isNativePartial(SEXP partial, int operation) {
+   R_xlen_t i;
+
+   if (operation == REDUCE_GENERIC || TYPEOF(partial) != REALSXP ||
+         ATTRIB(partial) != R_NilValue || XLENGTH(partial) > INT_MAX) {
+      return(FALSE);
+   }
+   if (operation != REDUCE_SUM && XLENGTH(partial) != 1) {
+      return(FALSE);
+   }
+   for(i = 0; i < XLENGTH(partial); i++) {
+      if (ISNAN(REAL(partial)[i])) {
+         return(FALSE);
+      }
+   }
+   return(TRUE);
+}
+
+/**
+   Combine the partial reductions with MPI_Reduce.
+
+   Processes without tasks contribute the identity of the operation.
+
+   @param[in] partial      R double vector, or NULL for no tasks
+   @param[in] operation    builtin reduction
+   @param[in] length       length of every partial reduction
+   @return                 R double vector on the supervisor, 
+                           R_NilValue elsewhere (not protected)
+*/
+static SEXP nativeReduce(SEXP partial, int operation, int length) {
+   int i;
+   double identity;
+   MPI_Op op;
+   SEXP contribution, result = R_NilValue;
+
+   switch(operation) {
+      case REDUCE_SUM:
+         op = MPI_SUM;
+         identity = 0;
+         break;
+      case REDUCE_MAX:
+         op = MPI_MAX;
+         identity = R_NegInf;
+         break;
+      default:
+         op = MPI_MIN;
+         identity = R_PosInf;
+         break;
+   }
+
+   if (partial == R_NilValue) {
+      PROTECT(contribution = allocVector(REALSXP, length));
+      for(i = 0; i < length; i++) {
+         REAL(contribution)[i] = identity;
+      }
+   } else {
+      PROTECT(contribution = partial);
+   }
+
+   if (readonly_rank == 0) {
+      PROTECT(result = allocVector(REALSXP, length));
+      MPI_Reduce(REAL(contribution), REAL(result), length, MPI_DOUBLE, op,
+         0, MPI_COMM_WORLD);
+      UNPROTECT(1);
+   } else {
+      MPI_Reduce(REAL(contribution), NULL, length, MPI_DOUBLE, op,
+         0, MPI_COMM_WORLD);
+   }
+
+   UNPROTECT(1);
+
+   return(result);
+}
+
+/**
+   Combine the partial reductions along a binomial tree.
+
+   At each step a process sends its serialized partial to the 
+   process to its left and drops out, so the supervisor receives 
+   log2(nproc) messages. An empty message stands for no tasks.
+
+   @param[in] partial      R partial reduction, or NULL for no tasks
+   @param[in] hasValue     FALSE if the process had no tasks
+   @param[in] theReduction R function of two arguments
+   @param[out] combined    TRUE if the returned value is a reduction
+   @return                 R combined value on the supervisor, 
+                           R_NilValue elsewhere (not protected)
+*/
+static SEXP treeReduce(SEXP partial, int hasValue, SEXP theReduction,
+      int *combined) {
+   int step;
+   R_xlen_t length;
+   MPI_Status status;
+   SEXP message;
+   PROTECT_INDEX index;
+
+   PROTECT_WITH_INDEX(partial, &index);
+
+   for(step = 1; step < readonly_nproc; step *= 2) {
+      if (readonly_rank % (2 * step) != 0) {
+         if (hasValue) {
+            PROTECT(message = serializeObject(partial));
+         } else {
+            PROTECT(message = allocVector(RAWSXP, 0));
+         }
+         sendBytes(RAW(message), XLENGTH(message), readonly_rank - step, 
+            TAG_REDUCE, MPI_COMM_WORLD);
+         UNPROTECT(2);
+         *combined = FALSE;
+         return(R_NilValue);
+      }
+      if (readonly_rank + step >= readonly_nproc) {
+         continue;
+      }
+      MPI_Probe(readonly_rank + step, TAG_REDUCE, MPI_COMM_WORLD, &status);
+      length = probedLength(&status);
+      if (length == 0) {
+         MPI_Recv(NULL, 0, MPI_BYTE, readonly_rank + step, TAG_REDUCE, 
+            MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+         continue;
+      }
+      PROTECT(message = allocVector(RAWSXP, length));
+      recvBytes(RAW(message), length, readonly_rank + step, TAG_REDUCE, 
+         MPI_COMM_WORLD);
+      message = unserializeRaw(message);
+      UNPROTECT(1);
+      PROTECT(message);
+      if (hasValue) {
+         REPROTECT(partial = combinePartials(theReduction, partial, 
+            message), index);
+      } else {
+         REPROTECT(partial = message, index);
+         hasValue = TRUE;
+      }
+      UNPROTECT(1);
+   }
+
+   UNPROTECT(1);
+   *combined = hasValue;
+
+   return(partial);
+}
+
+/**
+   Fold the results of the local tasks and combine the partials.
+
+   The processes agree with one reduction whether MPI_Reduce can
+   be used: it requires a builtin operation and native partials 
+   of the same length on every process with tasks.
+
+   @param[in] results      R list of the results of the local tasks
+   @param[in] theReduction R function of two arguments
+   @param[in] operation    builtin reduction, or REDUCE_GENERIC
+   @return                 R list holding the reduced value on the 
+                           supervisor, or an empty list if there were
+                           no tasks (not protected)
+*/
+static SEXP reduceResults(SEXP results, SEXP theReduction, int operation) {
+   int hasValue = LENGTH(results) > 0;
+   int combined = TRUE;
+   int local[3], global[3];
+   SEXP partial, value;
+
+   if (hasValue) {
+      PROTECT(partial = callReduce(theReduction, results));
+      local[0] = !isNativePartial(partial, operation);
+      local[1] = local[0] ? 0 : (int) XLENGTH(partial);
+      local[2] = -local[1];
+   } else {
+      PROTECT(partial = R_NilValue);
+      local[0] = FALSE;
+      local[1] = -1;
+      local[2] = -INT_MAX;
+   }
+
+   // Any non-native partial, or any two lengths that differ, 
+   // rule out MPI_Reduce.
+   MPI_Allreduce(local, global, 3, MPI_INT, MPI_MAX, MPI_COMM_WORLD);
+
+   if (!global[0] && global[1] >= 0 && global[1] == -global[2]) {
+      PROTECT(value = nativeReduce(partial, operation, global[1]));
+   } else {
+      PROTECT(value = treeReduce(partial, hasValue, theReduction, 
+         &combined));
+   }
+
+   if (readonly_rank > 0) {
+      UNPROTECT(2);
+      return(R_NilValue);
+   }
+
+   PROTECT(results = allocVector(VECSXP, combined ? 1 : 0));
+   if (combined) {
+      SET_VECTOR_ELT(results, 0, value);
+   }
+   UNPROTECT(3);
+
+   return(results);
+}
+
+
+SEXP mapReducePiebaldMPI(SEXP serializeFun, SEXP args, 
+      SEXP serializeRemainder, SEXP serializeReduce, SEXP reduceOperation,
+      SEXP argBase, SEXP argCount) {
+
+   checkPiebaldInit();
+
+   int operation = asInteger(reduceOperation);
+   SEXP theFunction, remainder, theReduction;
+   SEXP results;
+
+   sendCommand(MAP_REDUCE);
+
+   PROTECT(theFunction = sendFunction(serializeFun));
+
+   PROTECT(remainder = sendRemainder(serializeRemainder));
+
+   PROTECT(theReduction = sendCachedObject(serializeReduce));
+
+   MPI_Bcast(&operation, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+   lapplyPiebaldMPI_doSend(args, argBase, argCount);
+
+   PROTECT(results = localArgs(args, argBase, argCount));
+   results = callLapply(results, theFunction, remainder);
+   UNPROTECT(1);
+   PROTECT(results);
+
+   results = reduceResults(results, theReduction, operation);
+
+   UNPROTECT(4);
+
+   return(results);
+}
+
+
+void mapReduceWorkerPiebaldMPI() {
+   int operation;
+   SEXP theFunction, remainder, theReduction;
+   SEXP args, results;
+
+   theFunction = findFunction();
+
+   remainder = workerGetRemainder();
+
+   PROTECT(theReduction = receiveCachedObject());
+
+   MPI_Bcast(&operation, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+   args = workerReceiveArgs();
+
+   PROTECT(results = callLapply(args, theFunction, remainder));
+
+   reduceResults(results, theReduction, operation);
+
+   UNPROTECT(5);
+}
@@ -0,0 +1,34 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#ifndef _mapreduce_h
+#define _mapreduce_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+
+// Builtin reductions that are combined with MPI_Reduce.
+enum ReduceOperation { REDUCE_GENERIC, REDUCE_SUM, REDUCE_MAX, REDUCE_MIN };
+
+SEXP mapReducePiebaldMPI(SEXP serializeFun, SEXP args, 
+      SEXP serializeRemainder, SEXP serializeReduce, SEXP reduceOperation,
+      SEXP argBase, SEXP argCount);
+
+void mapReduceWorkerPiebaldMPI();
+
+#endif // _mapreduce_h
@@ -0,0 +1,152 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * Buffers reused across calls, so that short calls in a tight loop 
+ * do not allocate and page in fresh memory every time. Each process 
+ * keeps one send and one receive buffer, grown geometrically up to 
+ * a limit, plus per-rank scratch arrays of counts and requests.
+ * A buffer larger than the limit is freed as soon as it is released.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <stdint.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "pool.h"
+
+static unsigned char *buffers[POOL_BUFFERS];
+static R_xlen_t capacities[POOL_BUFFERS];
+static double poolLimit = 0;
+static int64_t *counts = NULL;
+static MPI_Request *requests = NULL;
+
+/**
+   Allocate the scratch arrays of the pool.
+
+   Must be called after readonly_nproc is known.
+
+   @param[in] limit        largest buffer kept between calls, in bytes
+*/
+void initBufferPool(double limit) {
+   int i;
+
+   poolLimit = limit;
+   for(i = 0; i < POOL_BUFFERS; i++) {
+      buffers[i] = NULL;
+      capacities[i] = 0;
+   }
+   counts   = Calloc(2 * readonly_nproc, int64_t);
+   requests = Calloc(readonly_nproc, MPI_Request);
+}
+
+/**
+   Free every buffer, keeping the scratch arrays.
+*/
+void trimBufferPool() {
+   int i;
+
+   for(i = 0; i < POOL_BUFFERS; i++) {
+      if (buffers[i] != NULL) {
+         Free(buffers[i]);
+      }
+      capacities[i] = 0;
+   }
+}
+
+void freeBufferPool() {
+   trimBufferPool();
+   Free(counts);
+   Free(requests);
+}
+
+/**
+   A pooled buffer of at least the given length.
+
+   The buffer grows to twice its capacity, or to the length if that
+   is larger, but not beyond the limit unless the length requires it.
+   The buffer is reallocated without being cleared, so its contents 
+   are kept when it grows and fresh pages are only touched when used.
+
+   @param[in] buffer       which buffer of the pool
+   @param[in] length       number of bytes needed
+   @return                 the buffer, valid until it is released
+*/
+unsigned char *poolBuffer(int buffer, R_xlen_t length) {
+   R_xlen_t capacity;
+
+   if (length <= capacities[buffer]) {
+      return(buffers[buffer]);
+   }
+
+   capacity = 2 * capacities[buffer];
+   if (capacity > poolLimit) {
+      capacity = (R_xlen_t) poolLimit;
+   }
+   if (capacity < length) {
+      capacity = length;
+   }
+
+   buffers[buffer] = Realloc(buffers[buffer], capacity, unsigned char);
+   capacities[buffer] = capacity;
+
+   return(buffers[buffer]);
+}
+
+/**
+   The caller is done with a pooled buffer.
+
+   A buffer grown beyond the limit is freed.
+
+   @param[in] buffer       which buffer of the pool
+*/
+void releasePoolBuffer(int buffer) {
+   if (capacities[buffer] > poolLimit) {
+      Free(buffers[buffer]);
+      capacities[buffer] = 0;
+   }
+}
+
+/**
+   Scratch array of 2 * readonly_nproc counts: byte counts per rank
+   followed by displacements per rank.
+*/
+int64_t *poolCounts() {
+   return(counts);
+}
+
+/**
+   Scratch array of readonly_nproc MPI requests.
+*/
+MPI_Request *poolRequests() {
+   return(requests);
+}
+
+
+SEXP trimBuffersPiebaldMPI() {
+   checkPiebaldInit();
+
+   sendCommand(TRIM_BUFFERS);
+
+   trimBufferPool();
+
+   return(R_NilValue);
+}
@@ -0,0 +1,40 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef _pool_h
+#define _pool_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <stdint.h>
+
+// The byte buffers kept by every process between calls.
+enum PoolBuffer { POOL_SEND, POOL_RECEIVE, POOL_BUFFERS };
+
+void initBufferPool(double limit);
+void freeBufferPool();
+void trimBufferPool();
+
+unsigned char *poolBuffer(int buffer, R_xlen_t length);
+void releasePoolBuffer(int buffer);
+int64_t *poolCounts();
+MPI_Request *poolRequests();
+
+SEXP trimBuffersPiebaldMPI();
+
+#endif // _pool_h
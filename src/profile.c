@@ -0,0 +1,176 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * Per-phase timers and byte counters.
+ *
+ * Phases nest: entering a phase pauses the phase that is running,
+ * so that each second is charged to exactly one phase. For example
+ * the unserialization of the arguments is not part of the scatter.
+ * When profiling is off, entering and leaving a phase is a single
+ * test. The counters are only exchanged when pbProfile() asks.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "profile.h"
+
+static int profileEnabled = FALSE;
+static int profileActive = -1;
+static double profileStart = 0;
+static double profileSeconds[PROFILE_PHASES];
+static double profileByteCounts[PROFILE_PHASES];
+
+static void resetProfile() {
+   int i;
+
+   for(i = 0; i < PROFILE_PHASES; i++) {
+      profileSeconds[i] = 0;
+      profileByteCounts[i] = 0;
+   }
+   profileActive = -1;
+}
+
+/**
+   Forget the running phase at the start of a command.
+
+   An R error leaves through the phases that were entered without
+   leaving them, so without this the time of later commands would be
+   charged to a phase that is no longer running.
+*/
+void profileIdle() {
+   profileActive = -1;
+}
+
+/**
+   Start timing a phase, pausing the phase that is running.
+
+   @param[in] phase        the phase
+   @return                 the paused phase, to pass to profileLeave()
+*/
+int profileEnter(int phase) {
+   int previous = profileActive;
+   double now;
+
+   if (!profileEnabled) {
+      return(PROFILE_OFF);
+   }
+
+   now = MPI_Wtime();
+   if (previous >= 0) {
+      profileSeconds[previous] += now - profileStart;
+   }
+   profileActive = phase;
+   profileStart = now;
+
+   return(previous);
+}
+
+/**
+   Stop timing the running phase and resume the paused phase.
+
+   @param[in] previous     the value returned by profileEnter()
+*/
+void profileLeave(int previous) {
+   double now;
+
+   if (previous == PROFILE_OFF) {
+      return;
+   }
+
+   now = MPI_Wtime();
+   profileSeconds[profileActive] += now - profileStart;
+   profileActive = previous;
+   profileStart = now;
+}
+
+/**
+   Count the bytes moved or produced by a phase.
+
+   @param[in] phase        the phase
+   @param[in] bytes        number of bytes
+*/
+void profileBytes(int phase, double bytes) {
+   if (profileEnabled) {
+      profileByteCounts[phase] += bytes;
+   }
+}
+
+/**
+   Carry out a profiling action on this process.
+
+   @param[in] action       PROFILE_DISABLE, PROFILE_ENABLE or PROFILE_REPORT
+   @param[out] report      the counters of every process, by process
+                           (supervisor only, for PROFILE_REPORT)
+*/
+static void profileAction(int action, double *report) {
+   double counters[2 * PROFILE_PHASES];
+
+   switch(action) {
+      case PROFILE_ENABLE:
+         resetProfile();
+         profileEnabled = TRUE;
+         break;
+      case PROFILE_DISABLE:
+         profileEnabled = FALSE;
+         break;
+      default:
+         memcpy(counters, profileSeconds, sizeof(profileSeconds));
+         memcpy(counters + PROFILE_PHASES, profileByteCounts, 
+            sizeof(profileByteCounts));
+         MPI_Gather(counters, 2 * PROFILE_PHASES, MPI_DOUBLE, report, 
+            2 * PROFILE_PHASES, MPI_DOUBLE, 0, MPI_COMM_WORLD);
+         break;
+   }
+}
+
+
+SEXP profilePiebaldMPI(SEXP action) {
+   checkPiebaldInit();
+
+   int theAction = asInteger(action);
+   SEXP report;
+
+   sendCommand(PROFILE);
+   MPI_Bcast(&theAction, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+   if (theAction != PROFILE_REPORT) {
+      profileAction(theAction, NULL);
+      return(R_NilValue);
+   }
+
+   PROTECT(report = allocVector(REALSXP, 
+      2 * PROFILE_PHASES * readonly_nproc));
+   profileAction(theAction, REAL(report));
+   UNPROTECT(1);
+
+   return(report);
+}
+
+
+void profileWorkerPiebaldMPI() {
+   int action;
+
+   MPI_Bcast(&action, 1, MPI_INT, 0, MPI_COMM_WORLD);
+
+   profileAction(action, NULL);
+}
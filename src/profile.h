@@ -0,0 +1,42 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+#ifndef _profile_h
+#define _profile_h
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+
+// Phases timed on every process. Keep in sync with profilePhases in R.
+enum ProfilePhase { PROFILE_SERIALIZE, PROFILE_BROADCAST, PROFILE_SCATTER,
+   PROFILE_COMPUTE, PROFILE_GATHER, PROFILE_UNSERIALIZE, PROFILE_PHASES };
+
+// Actions of the PROFILE command.
+enum ProfileAction { PROFILE_DISABLE, PROFILE_ENABLE, PROFILE_REPORT };
+
+// Returned by profileEnter() when profiling is off.
+#define PROFILE_OFF (-2)
+
+void profileIdle();
+int profileEnter(int phase);
+void profileLeave(int previous);
+void profileBytes(int phase, double bytes);
+
+SEXP profilePiebaldMPI(SEXP action);
+void profileWorkerPiebaldMPI();
+
+#endif // _profile_h
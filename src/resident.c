@@ -0,0 +1,212 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * Resident data is scattered once and kept by every process, so that
+ * iterative algorithms only send the function, the "..." arguments
+ * and the results on each call. Every process stores its partitions
+ * in the same order, so the index of a partition identifies it.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply.h"
+#include "lapply_helpers.h"
+#include "lapply_workers_helpers.h"
+#include "resident.h"
+
+static SEXP residentPartitions = NULL;
+static int numResident = 0;
+
+/**
+   Keep a partition on this process.
+
+   @param[in] partition    R list or vector of this process's tasks
+*/
+static void storePartition(SEXP partition) {
+   SEXP grown;
+
+   if (residentPartitions == NULL) {
+      PROTECT(partition);
+      residentPartitions = allocVector(VECSXP, 4);
+      R_PreserveObject(residentPartitions);
+      UNPROTECT(1);
+   } else if (numResident == LENGTH(residentPartitions)) {
+      PROTECT(partition);
+      grown = lengthgets(residentPartitions, 2 * numResident);
+      R_PreserveObject(grown);
+      R_ReleaseObject(residentPartitions);
+      residentPartitions = grown;
+      UNPROTECT(1);
+   }
+   SET_VECTOR_ELT(residentPartitions, numResident, partition);
+   numResident++;
+}
+
+/**
+   Check that resident data exists before the workers are involved.
+
+   @param[in] id           index of the resident data
+*/
+static void checkResident(int id) {
+   if (id < 0 || id >= numResident || 
+      VECTOR_ELT(residentPartitions, id) == R_NilValue) {
+      error("The distributed data does not exist or has been freed.");
+   }
+}
+
+/**
+   Broadcast the index of resident data from the supervisor.
+
+   @param[in] id           index of the resident data (supervisor only)
+   @return                 index of the resident data
+*/
+static int broadcastResident(int id) {
+   MPI_Bcast(&id, 1, MPI_INT, 0, MPI_COMM_WORLD);
+   return(id);
+}
+
+/**
+   Release every partition kept on this process.
+*/
+void clearResidentData() {
+   if (residentPartitions != NULL) {
+      R_ReleaseObject(residentPartitions);
+      residentPartitions = NULL;
+   }
+   numResident = 0;
+}
+
+
+SEXP distributePiebaldMPI(SEXP args, SEXP argBase, SEXP argCount) {
+   checkPiebaldInit();
+
+   sendCommand(DISTRIBUTE);
+
+   lapplyPiebaldMPI_doSend(args, argBase, argCount);
+
+   storePartition(localArgs(args, argBase, argCount));
+
+   return(ScalarInteger(numResident - 1));
+}
+
+SEXP lapplyResidentPiebaldMPI(SEXP serializeFun, SEXP serializeRemainder,
+      SEXP id, SEXP argLength) {
+
+   checkPiebaldInit();
+   checkResident(asInteger(id));
+
+   int index = asInteger(id);
+   SEXP workerResultsList, returnList;
+   SEXP theFunction, remainder;
+
+   PROTECT(workerResultsList = allocVector(VECSXP, readonly_nproc));
+   PROTECT(returnList = allocVector(VECSXP, asInteger(argLength)));
+
+   sendCommand(LAPPLY_RESIDENT);
+   broadcastResident(index);
+
+   PROTECT(theFunction = sendFunction(serializeFun));
+
+   PROTECT(remainder = sendRemainder(serializeRemainder));
+
+   SET_VECTOR_ELT(workerResultsList, 0, callLapply(
+      VECTOR_ELT(residentPartitions, index), theFunction, remainder));
+
+   lapplyPiebaldMPI_doReceive(workerResultsList, returnList);
+
+   UNPROTECT(4);
+
+   return(returnList);
+}
+
+SEXP collectPiebaldMPI(SEXP id, SEXP argLength) {
+   checkPiebaldInit();
+   checkResident(asInteger(id));
+
+   int index = asInteger(id);
+   SEXP workerResultsList, returnList;
+
+   PROTECT(workerResultsList = allocVector(VECSXP, readonly_nproc));
+   PROTECT(returnList = allocVector(VECSXP, asInteger(argLength)));
+
+   sendCommand(COLLECT);
+   broadcastResident(index);
+
+   SET_VECTOR_ELT(workerResultsList, 0, 
+      coerceVector(VECTOR_ELT(residentPartitions, index), VECSXP));
+
+   lapplyPiebaldMPI_doReceive(workerResultsList, returnList);
+
+   UNPROTECT(2);
+
+   return(returnList);
+}
+
+SEXP freeResidentPiebaldMPI(SEXP id) {
+   checkPiebaldInit();
+   checkResident(asInteger(id));
+
+   sendCommand(FREE_RESIDENT);
+   SET_VECTOR_ELT(residentPartitions, broadcastResident(asInteger(id)),
+      R_NilValue);
+
+   return(R_NilValue);
+}
+
+
+void distributeWorkerPiebaldMPI() {
+   storePartition(workerReceiveArgs());
+   UNPROTECT(1);
+}
+
+void lapplyResidentWorkerPiebaldMPI() {
+   int index = broadcastResident(0);
+   SEXP theFunction, remainder, returnList;
+
+   theFunction = findFunction();
+
+   remainder = workerGetRemainder();
+
+   returnList = evaluateReturnList(theFunction, remainder, 
+      VECTOR_ELT(residentPartitions, index));
+
+   sendReturnList(returnList);
+
+   UNPROTECT(3);
+}
+
+void collectWorkerPiebaldMPI() {
+   int index = broadcastResident(0);
+   SEXP partition;
+
+   PROTECT(partition = coerceVector(VECTOR_ELT(residentPartitions, index),
+      VECSXP));
+
+   sendReturnList(partition);
+
+   UNPROTECT(1);
+}
+
+void freeResidentWorkerPiebaldMPI() {
+   SET_VECTOR_ELT(residentPartitions, broadcastResident(0), R_NilValue);
+}
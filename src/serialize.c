@@ -0,0 +1,201 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * Serialization through the stream interface of R, without calling 
+ * serialize() and unserialize() through the interpreter. An object is 
+ * serialized in one pass into a pooled buffer, and unserialized 
+ * straight from the bytes that were received. The native
+ * binary format replaces XDR when every process has the same byte order.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <string.h>
+
+#include "serialize.h"
+#include "pool.h"
+
+// Initial size of a pooled buffer that an object is serialized into.
+#define SERIALIZE_INITIAL_LENGTH 4096
+
+/*
+ * An output stream writes into a pooled buffer, which grows as the
+ * object is written. An input stream reads from any byte array.
+ */
+typedef struct {
+   unsigned char *bytes;
+   R_xlen_t length;
+   R_xlen_t position;
+   int pool;
+} MemoryStream;
+
+static R_pstream_format_t serializeFormat = R_pstream_xdr_format;
+
+/**
+   Choose the format of serialized objects.
+
+   Must be called by every process after MPI_Init().
+*/
+void initSerialization() {
+   int one = 1;
+   int byteOrder[2];
+
+   byteOrder[0] = *(unsigned char *) &one;
+   byteOrder[1] = -byteOrder[0];
+   MPI_Allreduce(MPI_IN_PLACE, byteOrder, 2, MPI_INT, MPI_MAX, 
+      MPI_COMM_WORLD);
+
+   if (byteOrder[0] == -byteOrder[1]) {
+      serializeFormat = R_pstream_binary_format;
+   } else {
+      serializeFormat = R_pstream_xdr_format;
+   }
+}
+
+/**
+   Make room for more bytes in the buffer of an output stream.
+
+   The buffer grows to twice its size, or more if needed, keeping
+   the bytes written so far.
+
+   @param[in,out] output   the output stream
+   @param[in]     extra    number of bytes about to be written
+*/
+static void reserveBytes(MemoryStream *output, R_xlen_t extra) {
+   R_xlen_t capacity = 2 * output->length;
+
+   if (output->position + extra <= output->length) {
+      return;
+   }
+   if (capacity < output->position + extra) {
+      capacity = output->position + extra;
+   }
+
+   output->bytes = poolBuffer(output->pool, capacity);
+   output->length = capacity;
+}
+
+static void memoryOutChar(R_outpstream_t stream, int c) {
+   MemoryStream *output = (MemoryStream *) stream->data;
+
+   reserveBytes(output, 1);
+   output->bytes[output->position++] = (unsigned char) c;
+}
+
+static void memoryOutBytes(R_outpstream_t stream, void *buffer, int length) {
+   MemoryStream *output = (MemoryStream *) stream->data;
+
+   reserveBytes(output, length);
+   memcpy(output->bytes + output->position, buffer, length);
+   output->position += length;
+}
+
+static int memoryInChar(R_inpstream_t stream) {
+   MemoryStream *input = (MemoryStream *) stream->data;
+
+   if (input->position >= input->length) {
+      error("Unexpected end of a serialized object.");
+   }
+   return(input->bytes[input->position++]);
+}
+
+static void memoryInBytes(R_inpstream_t stream, void *buffer, int length) {
+   MemoryStream *input = (MemoryStream *) stream->data;
+
+   if (input->position > input->length - length) {
+      error("Unexpected end of a serialized object.");
+   }
+   memcpy(buffer, input->bytes + input->position, length);
+   input->position += length;
+}
+
+/**
+   Serialize an R object into a pooled buffer.
+
+   The object is serialized in a single pass into the buffer, which 
+   grows geometrically and keeps its capacity for later calls. The
+   caller reads the bytes from poolBuffer(buffer, length) and then
+   releases the buffer.
+
+   @param[in] object       R object to serialize
+   @param[in] buffer       which buffer of the pool
+   @return                 number of bytes written
+*/
+R_xlen_t serializeToPool(SEXP object, int buffer) {
+   MemoryStream output;
+   struct R_outpstream_st stream;
+
+   output.bytes    = poolBuffer(buffer, SERIALIZE_INITIAL_LENGTH);
+   output.length   = SERIALIZE_INITIAL_LENGTH;
+   output.position = 0;
+   output.pool     = buffer;
+   R_InitOutPStream(&stream, &output, serializeFormat, 0, 
+      memoryOutChar, memoryOutBytes, NULL, R_NilValue);
+   R_Serialize(object, &stream);
+
+   return(output.position);
+}
+
+/**
+   Serialize an R object into an R raw vector.
+
+   The object is serialized in a single pass into the pooled send 
+   buffer and then copied into a raw vector of exactly its size, so 
+   no slack is kept alive with the vector.
+
+   @param[in] object       R object to serialize
+   @return                 R raw vector (not protected)
+*/
+SEXP serializeToRaw(SEXP object) {
+   R_xlen_t length;
+   SEXP serialized;
+
+   PROTECT(object);
+   length = serializeToPool(object, POOL_SEND);
+   serialized = allocVector(RAWSXP, length);
+   memcpy(RAW(serialized), poolBuffer(POOL_SEND, length), length);
+   releasePoolBuffer(POOL_SEND);
+   UNPROTECT(1);
+
+   return(serialized);
+}
+
+/**
+   Unserialize an object from a byte array.
+
+   The bytes are read in place, so they may belong to a receive
+   buffer or a shared window as well as to an R raw vector.
+
+   @param[in] bytes        the serialized object (not compressed)
+   @param[in] length       number of bytes
+   @return                 the unserialized object (not protected)
+*/
+SEXP unserializeFromBytes(const unsigned char *bytes, R_xlen_t length) {
+   MemoryStream input;
+   struct R_inpstream_st stream;
+
+   input.bytes    = (unsigned char *) bytes;
+   input.length   = length;
+   input.position = 0;
+
+   R_InitInPStream(&stream, &input, R_pstream_any_format, 
+      memoryInChar, memoryInBytes, NULL, R_NilValue);
+
+   return(R_Unserialize(&stream));
+}
@@ -0,0 +1,172 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+/*
+ * Broadcast of large payloads through node-local shared memory.
+ *
+ * The processes are grouped by node with MPI_Comm_split_type().
+ * Only the first process of every node (the node leader) receives
+ * a large payload, directly into a shared window allocated on its 
+ * node. The other processes of the node unserialize straight from
+ * that window, so the node holds one copy of the serialized payload
+ * instead of one copy per process.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+#include <string.h>
+
+#include "state.h"
+#include "lapply_helpers.h"
+#include "compress.h"
+#include "shared.h"
+#include "bigcount.h"
+#include "profile.h"
+#include "serialize.h"
+
+/**
+   Create the communicators of the node and of the node leaders.
+
+   The supervisor is the leader of its node, and rank 0 of the 
+   communicator of the leaders.
+*/
+void initSharedMemory() {
+   MPI_Comm_split_type(MPI_COMM_WORLD, MPI_COMM_TYPE_SHARED, 0, 
+      MPI_INFO_NULL, &readonly_nodeComm);
+   MPI_Comm_rank(readonly_nodeComm, &readonly_nodeRank);
+   MPI_Comm_split(MPI_COMM_WORLD, 
+      readonly_nodeRank == 0 ? 0 : MPI_UNDEFINED, readonly_rank, 
+      &readonly_leaderComm);
+}
+
+void freeSharedMemory() {
+   if (readonly_leaderComm != MPI_COMM_NULL) {
+      MPI_Comm_free(&readonly_leaderComm);
+   }
+   MPI_Comm_free(&readonly_nodeComm);
+}
+
+/**
+   Unserialize an object from a byte array not owned by R.
+
+   Compressed bytes are decompressed in place, without copying them first.
+
+   @param[in] bytes        the serialized object, possibly compressed
+   @param[in] length       number of bytes
+   @return                 the unserialized object (not protected)
+*/
+SEXP unserializeBytes(const unsigned char *bytes, R_xlen_t length) {
+   SEXP serialized;
+   int phase;
+
+   phase = profileEnter(PROFILE_UNSERIALIZE);
+   profileBytes(PROFILE_UNSERIALIZE, length);
+   if (isCompressedBytes(bytes, length)) {
+      PROTECT(serialized = decompressBytes(bytes, length));
+      serialized = unserializeFromBytes(RAW(serialized), XLENGTH(serialized));
+      UNPROTECT(1);
+   } else {
+      serialized = unserializeFromBytes(bytes, length);
+   }
+   profileLeave(phase);
+
+   return(serialized);
+}
+
+/**
+   Broadcast a payload through a shared window on every node.
+
+   @param[in] serialized   R raw vector storing the payload 
+                           (supervisor only)
+   @param[in] length       number of bytes of the payload
+   @return                 the unserialized object on the workers,
+                           R_NilValue on the supervisor (not protected)
+*/
+static SEXP broadcastShared(SEXP serialized, R_xlen_t length) {
+   MPI_Win window;
+   MPI_Aint size;
+   int displacement;
+   unsigned char *base;
+   SEXP object;
+
+   MPI_Win_allocate_shared(readonly_nodeRank == 0 ? length : 0, 1, 
+      MPI_INFO_NULL, readonly_nodeComm, &base, &window);
+   if (readonly_nodeRank > 0) {
+      MPI_Win_shared_query(window, 0, &size, &displacement, &base);
+   }
+
+   MPI_Win_lock_all(MPI_MODE_NOCHECK, window);
+   if (readonly_nodeRank == 0) {
+      if (readonly_rank == 0) {
+         memcpy(base, RAW(serialized), length);
+      }
+      bcastBytes(base, length, 0, readonly_leaderComm);
+   }
+   MPI_Win_sync(window);
+   MPI_Barrier(readonly_nodeComm);
+   MPI_Win_sync(window);
+
+   if (readonly_rank == 0) {
+      object = R_NilValue;
+   } else {
+      object = unserializeBytes(base, length);
+   }
+   PROTECT(object);
+
+   MPI_Win_unlock_all(window);
+   MPI_Win_free(&window);
+   UNPROTECT(1);
+
+   return(object);
+}
+
+/**
+   Broadcast a payload from the supervisor to the workers.
+
+   The length of the payload must already be known by every process.
+   Large payloads go through node-local shared memory, smaller ones
+   are broadcast into a raw vector on every process. The supervisor
+   already holds the object, so it does not unserialize the payload.
+
+   @param[in] serialized   R raw vector storing the payload 
+                           (supervisor only)
+   @param[in] length       number of bytes of the payload
+   @return                 the unserialized object on the workers,
+                           R_NilValue on the supervisor (not protected)
+*/
+SEXP broadcastPayload(SEXP serialized, R_xlen_t length) {
+   SEXP object;
+
+   if (length >= SHARED_BROADCAST_THRESHOLD) {
+      return(broadcastShared(serialized, length));
+   }
+
+   if (readonly_rank == 0) {
+      bcastBytes(RAW(serialized), length, 0, MPI_COMM_WORLD);
+      return(R_NilValue);
+   }
+
+   PROTECT(serialized = allocVector(RAWSXP, length));
+
+   bcastBytes(RAW(serialized), length, 0, MPI_COMM_WORLD);
+
+   object = unserializeRaw(serialized);
+   UNPROTECT(1);
+
+   return(object);
+}
@@ -4,12 +4,21 @@
 #include "R.h"
 #include <Rinternals.h>
 #include <Rdefines.h>
+#include <mpi.h>
 
 // Global state. This variables should be read-only.
 extern int readonly_rank, readonly_nproc;
 extern int readonly_initialized;
 
-extern SEXP readonly_serialize, readonly_unserialize;
-extern SEXP readonly_lapply;
+// Communicator of the asynchronous jobs.
+extern MPI_Comm readonly_asyncComm;
+
+// Processes of the same node, and the first process of every node.
+extern MPI_Comm readonly_nodeComm, readonly_leaderComm;
+extern int readonly_nodeRank;
+extern int readonly_hierarchical;
+
+extern SEXP readonly_lapply, readonly_vapply, readonly_reduce;
+extern SEXP readonly_mapply;
 
 #endif // #define _state_h
@@ -0,0 +1,131 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+/*
+ * Native buffers for the atomic vector types that can be
+ * sent without serialization: logical, integer, double and complex.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <mpi.h>
+
+#include "typed.h"
+
+/**
+   Test whether a vector can be sent as a native typed buffer.
+
+   @param[in] x      R object
+   @return           TRUE for logical, integer, double or complex vectors
+*/
+int isTypedVector(SEXP x) {
+   switch(TYPEOF(x)) {
+      case LGLSXP:
+      case INTSXP:
+      case REALSXP:
+      case CPLXSXP:
+         return(TRUE);
+      default:
+         return(FALSE);
+   }
+}
+
+/**
+   The MPI datatype of one element of a typed vector.
+
+   @param[in] type   R vector type
+   @return           MPI datatype
+*/
+MPI_Datatype typedDatatype(SEXPTYPE type) {
+   switch(type) {
+      case LGLSXP:
+      case INTSXP:
+         return(MPI_INT);
+      case REALSXP:
+         return(MPI_DOUBLE);
+      case CPLXSXP:
+         return(MPI_C_DOUBLE_COMPLEX);
+      default:
+         error("Vectors of type %d cannot be sent as native buffers.", type);
+   }
+   return(MPI_DATATYPE_NULL);
+}
+
+/**
+   The size in bytes of one element of a typed vector.
+
+   @param[in] type   R vector type
+   @return           element size in bytes
+*/
+size_t typedElementSize(SEXPTYPE type) {
+   switch(type) {
+      case LGLSXP:
+      case INTSXP:
+         return(sizeof(int));
+      case REALSXP:
+         return(sizeof(double));
+      case CPLXSXP:
+         return(sizeof(Rcomplex));
+      default:
+         error("Vectors of type %d cannot be sent as native buffers.", type);
+   }
+   return(0);
+}
+
+/**
+   The data of a typed vector.
+
+   @param[in] x      R logical, integer, double or complex vector
+   @return           pointer to the first element
+*/
+unsigned char *typedDataPointer(SEXP x) {
+   switch(TYPEOF(x)) {
+      case LGLSXP:
+         return((unsigned char*) LOGICAL(x));
+      case INTSXP:
+         return((unsigned char*) INTEGER(x));
+      case REALSXP:
+         return((unsigned char*) REAL(x));
+      case CPLXSXP:
+         return((unsigned char*) COMPLEX(x));
+      default:
+         error("Vectors of type %d cannot be sent as native buffers.", 
+            TYPEOF(x));
+   }
+   return(NULL);
+}
+
+/**
+   Copy a contiguous segment of a typed vector.
+
+   @param[in] x         R logical, integer, double or complex vector
+   @param[in] base      1-based index of the first element
+   @param[in] length    number of elements
+   @return              R vector of the same type (not protected)
+*/
+SEXP typedSegment(SEXP x, int base, int length) {
+   size_t size = typedElementSize(TYPEOF(x));
+   SEXP segment;
+
+   segment = allocVector(TYPEOF(x), length);
+   if (length > 0) {
+      memcpy(typedDataPointer(segment), 
+         typedDataPointer(x) + (size_t) (base - 1) * size, length * size);
+   }
+
+   return(segment);
+}
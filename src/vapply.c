@@ -0,0 +1,183 @@
+/*
+ *  Copyright 2011 The OpenMx Project
+ *
+ *  Licensed under the Apache License, Version 2.0 (the "License");
+ *  you may not use this file except in compliance with the License.
+ *  You may obtain a copy of the License at
+ *
+ *       http://www.apache.org/licenses/LICENSE-2.0
+ *
+ *   Unless required by applicable law or agreed to in writing, software
+ *   distributed under the License is distributed on an "AS IS" BASIS,
+ *   WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ *  See the License for the specific language governing permissions and
+ *  limitations under the License.
+ */
+
+#include "R.h"
+#include <Rinternals.h>
+#include <Rdefines.h>
+#include <R_ext/Rdynload.h>
+#include <mpi.h>
+
+#include "init_finalize.h"
+#include "commands.h"
+#include "state.h"
+#include "lapply.h"
+#include "lapply_helpers.h"
+#include "lapply_workers_helpers.h"
+#include "cache.h"
+#include "typed.h"
+#include "vapply.h"
+#include "profile.h"
+
+/**
+   Evaluate vapply(args, theFunction, funValue, ..., USE.NAMES = FALSE).
+
+   The result is a vector (or a matrix with one column per task)
+   whose data holds the values of each task contiguously, in order.
+
+   @param[in] args         R list or vector of arguments
+   @param[in] theFunction  R function to apply
+   @param[in] funValue     R template for the return value of the function
+   @param[in] remainder    R list of "..." arguments
+   @return                 R vector of the type of funValue (not protected)
+*/
+SEXP callVapply(SEXP args, SEXP theFunction, SEXP funValue, 
+   SEXP remainder) {
+
+   SEXP functionCall, useNames, value;
+   int phase = profileEnter(PROFILE_COMPUTE);
+
+   PROTECT(useNames = CONS(ScalarLogical(FALSE), R_NilValue));
+   SET_TAG(useNames, install("USE.NAMES"));
+   SETCDR(useNames, Rf_VectorToPairList(remainder));
+
+   PROTECT(functionCall = LCONS(readonly_vapply, LCONS(args, 
+      LCONS(theFunction, LCONS(funValue, useNames)))));
+   value = eval(functionCall, R_GlobalEnv);
+   UNPROTECT(2);
+   profileLeave(phase);
+
+   return(value);
+}
+
+/**
+   Gather the typed results of every process into the result vector.
+
+   The results of each rank are received in place at the position 
+   of its first task, so no further copy is needed. Counts and 
+   displacements are in units of one task's values, so they stay
+   within an int however long the result vector is.
+
+   @param[in]  values      R vector holding the results of this process
+   @param[out] result      R vector storing the results of every task 
+                           (supervisor only)
+   @param[in]  argBase     R integer vector of 1-based segment offsets
+                           (supervisor only)
+   @param[in]  argCount    R integer vector of segment lengths
+                           (supervisor only)
+   @param[in]  valueLength number of values returned by each task
+*/
+void gatherTypedResults(SEXP values, SEXP result, SEXP argBase, 
+   SEXP argCount, int valueLength) {
+
+   int i;
+   int *counts, *displacements;
+   size_t valueBytes = valueLength * typedElementSize(TYPEOF(values));
+   MPI_Datatype datatype;
+   int phase = profileEnter(PROFILE_GATHER);
+
+   MPI_Type_contiguous(valueLength, typedDatatype(TYPEOF(values)), 
+      &datatype);
+   MPI_Type_commit(&datatype);
+
+   if (readonly_rank > 0) {
+      MPI_Gatherv(typedDataPointer(values), 
+         (int) (XLENGTH(values) / valueLength), datatype, 
+         NULL, NULL, NULL, datatype, 0, MPI_COMM_WORLD);
+      MPI_Type_free(&datatype);
+      profileBytes(PROFILE_GATHER, XLENGTH(values) * 
+         typedElementSize(TYPEOF(values)));
+      profileLeave(phase);
+      return;
+   }
+
+   counts        = Calloc(readonly_nproc, int);
+   displacements = Calloc(readonly_nproc, int);
+
+   for(i = 0; i < readonly_nproc; i++) {
+      counts[i] = INTEGER(argCount)[i];
+      displacements[i] = INTEGER(argBase)[i] - 1;
+   }
+
+   if (counts[0] > 0) {
+      memcpy(typedDataPointer(result) + displacements[0] * valueBytes, 
+         typedDataPointer(values), counts[0] * valueBytes);
+   }
+
+   MPI_Gatherv(MPI_IN_PLACE, 0, datatype, typedDataPointer(result), 
+      counts, displacements, datatype, 0, MPI_COMM_WORLD);
+
+   MPI_Type_free(&datatype);
+   Free(counts);
+   Free(displacements);
+   profileLeave(phase);
+}
+
+
+SEXP vapplyPiebaldMPI(SEXP serializeFun, SEXP args, 
+      SEXP serializeRemainder, SEXP serializeValue, SEXP argBase, 
+      SEXP argCount) {
+
+   checkPiebaldInit();
+
+   int length = sumCounts(argCount);
+   SEXP theFunction, remainder, funValue;
+   SEXP result, values;
+
+   sendCommand(VAPPLY);
+
+   PROTECT(theFunction = sendFunction(serializeFun));
+
+   PROTECT(remainder = sendRemainder(serializeRemainder));
+
+   PROTECT(funValue = sendCachedObject(serializeValue));
+
+   PROTECT(result = allocVector(TYPEOF(funValue), 
+      (R_xlen_t) length * LENGTH(funValue)));
+
+   lapplyPiebaldMPI_doSend(args, argBase, argCount);
+
+   PROTECT(values = localArgs(args, argBase, argCount));
+   values = callVapply(values, theFunction, funValue, remainder);
+   UNPROTECT(1);
+   PROTECT(values);
+
+   gatherTypedResults(values, result, argBase, argCount, LENGTH(funValue));
+
+   UNPROTECT(5);
+
+   return(result);
+}
+
+
+void vapplyWorkerPiebaldMPI() {
+   SEXP theFunction, remainder, funValue;
+   SEXP args, values;
+
+   theFunction = findFunction();
+
+   remainder = workerGetRemainder();
+
+   PROTECT(funValue = receiveCachedObject());
+
+   args = workerReceiveArgs();
+
+   PROTECT(values = callVapply(args, theFunction, funValue, remainder));
+
+   gatherTypedResults(values, R_NilValue, R_NilValue, R_NilValue, 
+      LENGTH(funValue));
+
+   UNPROTECT(5);
+}